@@ -20,7 +20,7 @@ parse_log() {
             local timestamp="${BASH_REMATCH[1]}"
             local src="${BASH_REMATCH[2]}"
             local tgt="${BASH_REMATCH[3]}"
-            local result="${BASH_REMATCH[5]}"
+            local result="${BASH_REMATCH[6]}"
 			dir["$src"]="$tgt"
 			monitored["$src"]=1
             last_sync["$src"]="$timestamp"
@@ -52,6 +52,12 @@ case "$cmd" in
             echo "Error: $path is not a valid log file." >&2
             exit 1
         fi
+        # The compiled report tool answers from the index of the binary event log instead of reading the whole log
+        for report in "$(dirname "$0")/fss_report" "$(dirname "$0")/../fss_report"; do
+            if [[ -x "$report" && -f "$path.events" ]]; then
+                exec "$report" -p "$path" -c "$cmd"
+            fi
+        done
         parse_log "$path"
         case "$cmd" in
             listAll)
@@ -87,7 +93,7 @@ case "$cmd" in
             fi
         elif [[ -f "$path" ]]; then
             echo "Deleting $path..."
-            if rm -f "$path"; then
+            if rm -f "$path" "$path.events" "$path.idx"; then
                 echo "Purge complete."
             else
                 echo "Error: Failed to delete file." >&2
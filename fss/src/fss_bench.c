@@ -0,0 +1,761 @@
+/* File: fss_bench.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Filesystem operations done between two looks at the target
+#define POLL_EVERY_OPS 64
+
+// Largest write done at once, and the data all files are made of
+#define CHUNK_SIZE (1024 * 1024)
+
+// Deepest directory of the deep scenario, below the source
+#define MAX_DEPTH 8
+
+typedef struct bench Bench;
+
+typedef struct expectation Expectation;
+
+typedef struct scenario Scenario;
+
+typedef struct result Result;
+
+// The state a file of the source must reach in the target, and since when
+struct expectation {
+	char *path;         // relative to the source and the target
+	long long size;     // -1 when the file must not exist
+	long long changed_us;
+	int outstanding;    // the target has not shown this state yet
+	int unchanged;      // the target was already in this state, e.g. a file deleted before it was copied
+	Expectation *hash_next;
+};
+
+// One run of the manager under a workload
+struct bench {
+	char source[PATH_MAX];
+	char target[PATH_MAX];
+	unsigned long long rng;
+	Expectation **buckets;
+	size_t bucket_count;
+	size_t expectation_count;
+	Expectation **outstanding;
+	size_t outstanding_count;
+	size_t outstanding_cap;
+	long long *latencies; // microseconds from the last change of a file to the target showing it
+	size_t latency_count;
+	size_t latency_cap;
+	unsigned long long ops;
+	unsigned long long bytes;
+	char **dirs;          // directories created so far, "" for the source
+	size_t dir_count;
+	size_t dir_cap;
+};
+
+struct scenario {
+	const char *name;
+	const char *description;
+	void (*run)(Bench *bench, int files);
+};
+
+// Numbers of a scenario, as printed and written to the CSV file
+struct result {
+	char name[32];
+	unsigned long long ops;
+	unsigned long long bytes;
+	double seconds;
+	double ops_per_sec;
+	double mb_per_sec;
+	double p50_ms;
+	double p99_ms;
+	double cpu_seconds;
+	double cpu_percent;
+	size_t mismatches;
+};
+
+static char data[CHUNK_SIZE];
+static char manager_path[PATH_MAX];
+static char worker_path[PATH_MAX];
+static char **manager_args = NULL; // options passed through to fss_manager after --
+static int manager_arg_count = 0;
+static int timeout_s = 120;
+
+long long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// xorshift64*, seeded so that every run does the same operations
+unsigned long long next_random(Bench *bench) {
+	bench->rng ^= bench->rng >> 12;
+	bench->rng ^= bench->rng << 25;
+	bench->rng ^= bench->rng >> 27;
+	return bench->rng * 2685821657736338717ULL;
+}
+
+long long random_between(Bench *bench, long long low, long long high) {
+	return low + (long long)(next_random(bench) % (unsigned long long)(high - low + 1));
+}
+
+size_t hash_path(const char *path) {
+	size_t hash = 14695981039346656037ULL;
+	for (; *path; path++)
+		hash = (hash ^ (unsigned char)*path) * 1099511628211ULL;
+	return hash;
+}
+
+Expectation *find_expectation(Bench *bench, const char *path) {
+	if (!bench->bucket_count)
+		return NULL;
+	for (Expectation *curr = bench->buckets[hash_path(path) % bench->bucket_count]; curr; curr = curr->hash_next) {
+		if (!strcmp(curr->path, path))
+			return curr;
+	}
+	return NULL;
+}
+
+// Function to tell whether the target shows the expected state of a file
+int target_matches(Bench *bench, const Expectation *entry) {
+	char path[PATH_MAX * 2];
+	snprintf(path, sizeof(path), "%s/%s", bench->target, entry->path);
+	struct stat st;
+	if (lstat(path, &st) == -1)
+		return entry->size == -1 && errno == ENOENT;
+	return entry->size != -1 && S_ISREG(st.st_mode) && st.st_size == entry->size;
+}
+
+// Function to record the state a file has now in the source, which the target must show next
+void expect(Bench *bench, const char *path, long long size) {
+	if (bench->expectation_count >= bench->bucket_count) {
+		size_t count = bench->bucket_count ? bench->bucket_count * 2 : 1024;
+		Expectation **buckets = calloc(count, sizeof(*buckets));
+		for (size_t i = 0; i < bench->bucket_count; i++) {
+			Expectation *curr = bench->buckets[i];
+			while (curr) {
+				Expectation *next = curr->hash_next;
+				size_t bucket = hash_path(curr->path) % count;
+				curr->hash_next = buckets[bucket];
+				buckets[bucket] = curr;
+				curr = next;
+			}
+		}
+		free(bench->buckets);
+		bench->buckets = buckets;
+		bench->bucket_count = count;
+	}
+
+	Expectation *entry = find_expectation(bench, path);
+	if (!entry) {
+		entry = calloc(1, sizeof(*entry));
+		entry->path = strdup(path);
+		size_t bucket = hash_path(path) % bench->bucket_count;
+		entry->hash_next = bench->buckets[bucket];
+		bench->buckets[bucket] = entry;
+		bench->expectation_count++;
+	}
+	entry->size = size;
+	entry->changed_us = now_us();
+	entry->unchanged = size == -1 && target_matches(bench, entry);
+	if (!entry->outstanding) {
+		if (bench->outstanding_count == bench->outstanding_cap) {
+			bench->outstanding_cap = bench->outstanding_cap ? bench->outstanding_cap * 2 : 1024;
+			bench->outstanding = realloc(bench->outstanding, bench->outstanding_cap * sizeof(*bench->outstanding));
+		}
+		bench->outstanding[bench->outstanding_count++] = entry;
+		entry->outstanding = 1;
+	}
+}
+
+// Function to look at the target for every file that has not reached its state yet
+void poll_target(Bench *bench) {
+	long long now = now_us();
+	for (size_t i = 0; i < bench->outstanding_count;) {
+		Expectation *entry = bench->outstanding[i];
+		if (!target_matches(bench, entry)) {
+			i++;
+			continue;
+		}
+		entry->outstanding = 0;
+		bench->outstanding[i] = bench->outstanding[--bench->outstanding_count];
+		// Nothing had to reach the target, there is no latency to measure
+		if (entry->unchanged)
+			continue;
+		if (bench->latency_count == bench->latency_cap) {
+			bench->latency_cap = bench->latency_cap ? bench->latency_cap * 2 : 1024;
+			bench->latencies = realloc(bench->latencies, bench->latency_cap * sizeof(*bench->latencies));
+		}
+		bench->latencies[bench->latency_count++] = now - entry->changed_us;
+	}
+}
+
+// Function to count an operation on the source, looking at the target every POLL_EVERY_OPS of them
+void count_op(Bench *bench, unsigned long long bytes) {
+	bench->ops++;
+	bench->bytes += bytes;
+	if (bench->ops % POLL_EVERY_OPS == 0)
+		poll_target(bench);
+}
+
+void source_path(Bench *bench, const char *path, char *buf, size_t size) {
+	snprintf(buf, size, "%s/%s", bench->source, path);
+}
+
+// Function to write size bytes to a file of the source, at its end when append is set
+void write_file(Bench *bench, const char *path, long long size, int append) {
+	char full_path[PATH_MAX * 2];
+	source_path(bench, path, full_path, sizeof(full_path));
+	int fd = open(full_path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+	if (fd == -1) {
+		perror(full_path);
+		return;
+	}
+	long long left = size;
+	while (left > 0) {
+		ssize_t written = write(fd, data, left < CHUNK_SIZE ? left : CHUNK_SIZE);
+		if (written <= 0) {
+			perror(full_path);
+			break;
+		}
+		left -= written;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	close(fd);
+	expect(bench, path, st.st_size);
+	count_op(bench, size - left);
+}
+
+void remove_file(Bench *bench, const char *path) {
+	char full_path[PATH_MAX * 2];
+	source_path(bench, path, full_path, sizeof(full_path));
+	if (unlink(full_path) == -1) {
+		perror(full_path);
+		return;
+	}
+	expect(bench, path, -1);
+	count_op(bench, 0);
+}
+
+void rename_file(Bench *bench, const char *from, const char *to) {
+	char from_path[PATH_MAX * 2], to_path[PATH_MAX * 2];
+	source_path(bench, from, from_path, sizeof(from_path));
+	source_path(bench, to, to_path, sizeof(to_path));
+	struct stat st;
+	if (stat(from_path, &st) == -1 || rename(from_path, to_path) == -1) {
+		perror(from_path);
+		return;
+	}
+	expect(bench, from, -1);
+	expect(bench, to, st.st_size);
+	count_op(bench, 0);
+}
+
+// Function to create a directory of the source, returning its index in bench->dirs
+size_t make_dir(Bench *bench, const char *path) {
+	char full_path[PATH_MAX * 2];
+	source_path(bench, path, full_path, sizeof(full_path));
+	if (mkdir(full_path, 0755) == -1 && errno != EEXIST)
+		perror(full_path);
+	if (bench->dir_count == bench->dir_cap) {
+		bench->dir_cap = bench->dir_cap ? bench->dir_cap * 2 : 64;
+		bench->dirs = realloc(bench->dirs, bench->dir_cap * sizeof(*bench->dirs));
+	}
+	bench->dirs[bench->dir_count] = strdup(path);
+	count_op(bench, 0);
+	return bench->dir_count++;
+}
+
+// Function to make the name of a file in a directory of bench->dirs
+void file_in(Bench *bench, size_t dir, const char *name, char *buf, size_t size) {
+	if (*bench->dirs[dir])
+		snprintf(buf, size, "%s/%s", bench->dirs[dir], name);
+	else
+		snprintf(buf, size, "%s", name);
+}
+
+// Many small files, 512 bytes to 16 KiB, in a few directories
+void run_small(Bench *bench, int files) {
+	for (int i = 0; i < 16; i++) {
+		char dir[32];
+		snprintf(dir, sizeof(dir), "d%02d", i);
+		make_dir(bench, dir);
+	}
+	for (int i = 0; i < files; i++) {
+		char name[32], path[PATH_MAX];
+		snprintf(name, sizeof(name), "f%06d", i);
+		file_in(bench, 1 + i % 16, name, path, sizeof(path));
+		write_file(bench, path, random_between(bench, 512, 16 * 1024), 0);
+	}
+}
+
+// Files of mixed sizes: 70% below 64 KiB, 25% below 1 MiB, 5% up to 16 MiB
+void run_sizes(Bench *bench, int files) {
+	for (int i = 0; i < files / 4; i++) {
+		long long kind = random_between(bench, 0, 99);
+		long long size = kind < 70 ? random_between(bench, 1, 64 * 1024)
+					   : kind < 95 ? random_between(bench, 64 * 1024, 1024 * 1024)
+					   : random_between(bench, 1024 * 1024, 16 * 1024 * 1024);
+		char path[32];
+		snprintf(path, sizeof(path), "f%06d", i);
+		write_file(bench, path, size, 0);
+	}
+}
+
+// A few large files that keep growing by 1 MiB appends
+void run_append(Bench *bench, int files) {
+	int appends = files / 125 > 0 ? files / 125 : 1;
+	for (int i = 0; i < appends; i++) {
+		for (int f = 0; f < 4; f++) {
+			char path[32];
+			snprintf(path, sizeof(path), "log%d", f);
+			write_file(bench, path, CHUNK_SIZE, 1);
+		}
+	}
+}
+
+// A tree up to MAX_DEPTH levels deep, the files written while it grows
+void run_deep(Bench *bench, int files) {
+	int dirs = files / 20 > 0 ? files / 20 : 1;
+	for (int i = 0; i < dirs; i++) {
+		// Under a random directory that is not at the deepest level yet
+		size_t parent;
+		int depth;
+		do {
+			parent = random_between(bench, 0, bench->dir_count - 1);
+			depth = 0;
+			for (const char *c = bench->dirs[parent]; *c; c++)
+				depth += *c == '/';
+			depth += *bench->dirs[parent] != '\0';
+		} while (depth >= MAX_DEPTH);
+		char name[32], path[PATH_MAX];
+		snprintf(name, sizeof(name), "d%05d", i);
+		file_in(bench, parent, name, path, sizeof(path));
+		size_t dir = make_dir(bench, path);
+
+		for (int f = 0; f < files / dirs / 2; f++) {
+			snprintf(name, sizeof(name), "f%03d", f);
+			file_in(bench, dir, name, path, sizeof(path));
+			write_file(bench, path, random_between(bench, 512, 32 * 1024), 0);
+		}
+	}
+}
+
+// Random creates, modifications, deletions and renames on a small set of names, so that operations on the same
+// file follow each other closely
+void run_storm(Bench *bench, int files) {
+	int names = files / 10 > 0 ? files / 10 : 1;
+	for (int i = 0; i < files; i++) {
+		char path[32], other[32];
+		snprintf(path, sizeof(path), "s%05lld", random_between(bench, 0, names - 1));
+		Expectation *entry = find_expectation(bench, path);
+		int exists = entry && entry->size != -1;
+		long long action = random_between(bench, 0, 99);
+
+		if (!exists)
+			write_file(bench, path, random_between(bench, 1, 8 * 1024), 0);
+		else if (action < 50)
+			write_file(bench, path, random_between(bench, 1, 4 * 1024), 1);
+		else if (action < 75)
+			remove_file(bench, path);
+		else {
+			snprintf(other, sizeof(other), "s%05lld", random_between(bench, 0, names - 1));
+			Expectation *other_entry = find_expectation(bench, other);
+			if (strcmp(path, other) && !(other_entry && other_entry->size != -1))
+				rename_file(bench, path, other);
+			else
+				write_file(bench, path, random_between(bench, 1, 4 * 1024), 1);
+		}
+	}
+}
+
+static Scenario scenarios[] = {
+	{ "small", "many small files", run_small },
+	{ "sizes", "mixed file sizes", run_sizes },
+	{ "append", "large appends", run_append },
+	{ "deep", "deep directory tree", run_deep },
+	{ "storm", "create/modify/delete/rename storm", run_storm },
+};
+
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	return remove(path);
+}
+
+// Function to read what the manager sends through fss_out until a line contains text. Returns -1 on timeout
+int wait_for_response(int fd, const char *text, int timeout_ms) {
+	char buf[4096];
+	size_t len = 0;
+	long long deadline = now_us() + (long long)timeout_ms * 1000;
+	while (now_us() < deadline) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		ssize_t bytes = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (bytes <= 0) {
+			if (bytes == 0 || errno != EAGAIN)
+				usleep(10000);
+			continue;
+		}
+		len += bytes;
+		buf[len] = '\0';
+		if (strstr(buf, text))
+			return 0;
+		// Keep the last line, which may be incomplete
+		char *last = strrchr(buf, '\n');
+		if (last) {
+			len = strlen(last + 1);
+			memmove(buf, last + 1, len + 1);
+		}
+		if (len == sizeof(buf) - 1)
+			len = 0;
+	}
+	return -1;
+}
+
+int send_command(int fd, const char *command) {
+	size_t len = strlen(command);
+	return write(fd, command, len) == (ssize_t)len ? 0 : -1;
+}
+
+// Function to start fss_manager in dir with an empty configuration, stdout in dir/manager.out
+pid_t start_manager(const char *dir) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (chdir(dir) == -1) {
+			perror(dir);
+			_exit(EXIT_FAILURE);
+		}
+		int out = open("manager.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		dup2(out, STDOUT_FILENO);
+		dup2(out, STDERR_FILENO);
+		char **args = calloc(manager_arg_count + 6, sizeof(*args));
+		int count = 0;
+		args[count++] = "fss_manager";
+		args[count++] = "-l";
+		args[count++] = "manager.log";
+		args[count++] = "-c";
+		args[count++] = "config.txt";
+		for (int i = 0; i < manager_arg_count; i++)
+			args[count++] = manager_args[i];
+		execv(manager_path, args);
+		perror("execv");
+		_exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+int compare_latencies(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+// Function to run a scenario against a new manager in dir. Returns 0, or -1 if the manager did not work
+int run_scenario(const Scenario *scenario, const char *dir, int files, unsigned long long seed, Result *result) {
+	char path[PATH_MAX * 3];
+	Bench bench;
+	memset(&bench, 0, sizeof(bench));
+	bench.rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+	snprintf(bench.source, sizeof(bench.source), "%s/source", dir);
+	snprintf(bench.target, sizeof(bench.target), "%s/target", dir);
+	bench.dirs = malloc(sizeof(*bench.dirs));
+	bench.dirs[0] = strdup("");
+	bench.dir_count = bench.dir_cap = 1;
+
+	if (mkdir(dir, 0755) == -1 || mkdir(bench.source, 0755) == -1) {
+		perror(dir);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/config.txt", dir);
+	close(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+	snprintf(path, sizeof(path), "%s/worker", dir);
+	if (symlink(worker_path, path) == -1) {
+		perror(path);
+		return -1;
+	}
+
+	struct rusage before, after;
+	getrusage(RUSAGE_CHILDREN, &before);
+	pid_t pid = start_manager(dir);
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+
+	// The manager opens fss_in and then fss_out, each waiting for the other end
+	char in_path[PATH_MAX * 2], out_path[PATH_MAX * 2];
+	snprintf(in_path, sizeof(in_path), "%s/fss_in", dir);
+	snprintf(out_path, sizeof(out_path), "%s/fss_out", dir);
+	struct stat st;
+	for (int i = 0; i < 500 && (stat(in_path, &st) == -1 || stat(out_path, &st) == -1); i++)
+		usleep(10000);
+	int in_fd = open(in_path, O_WRONLY);
+	int out_fd = in_fd == -1 ? -1 : open(out_path, O_RDONLY | O_NONBLOCK);
+	if (out_fd == -1) {
+		perror("open named pipes");
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "add %s %s\n", bench.source, bench.target);
+	if (send_command(in_fd, path) == -1 || wait_for_response(out_fd, "Monitoring started", 10000) == -1) {
+		fprintf(stderr, "%s: the manager did not start monitoring, see %s/manager.out\n", scenario->name, dir);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	// Let the FULL of the empty source go by
+	usleep(200000);
+
+	long long start = now_us();
+	scenario->run(&bench, files);
+	long long deadline = now_us() + (long long)timeout_s * 1000000;
+	while (bench.outstanding_count && now_us() < deadline) {
+		poll_target(&bench);
+		if (bench.outstanding_count)
+			usleep(1000);
+	}
+	long long end = now_us();
+
+	// Whatever the target shows now must be what the source has
+	result->mismatches = 0;
+	for (size_t i = 0; i < bench.bucket_count; i++) {
+		for (Expectation *curr = bench.buckets[i]; curr; curr = curr->hash_next)
+			result->mismatches += !target_matches(&bench, curr);
+	}
+
+	send_command(in_fd, "shutdown\n");
+	if (wait_for_response(out_fd, "Manager shutdown complete", timeout_s * 1000) == -1)
+		kill(pid, SIGKILL);
+	close(in_fd);
+	close(out_fd);
+	waitpid(pid, NULL, 0);
+	getrusage(RUSAGE_CHILDREN, &after);
+
+	// Workers are children of the manager, so their time is in its RUSAGE_CHILDREN share
+	double cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_stime.tv_sec - before.ru_stime.tv_sec) +
+				 ((after.ru_utime.tv_usec - before.ru_utime.tv_usec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec)) / 1e6;
+	qsort(bench.latencies, bench.latency_count, sizeof(*bench.latencies), compare_latencies);
+
+	snprintf(result->name, sizeof(result->name), "%s", scenario->name);
+	result->ops = bench.ops;
+	result->bytes = bench.bytes;
+	result->seconds = (end - start) / 1e6;
+	result->ops_per_sec = result->seconds > 0 ? bench.ops / result->seconds : 0;
+	result->mb_per_sec = result->seconds > 0 ? bench.bytes / result->seconds / (1024 * 1024) : 0;
+	result->p50_ms = bench.latency_count ? bench.latencies[bench.latency_count / 2] / 1000.0 : 0;
+	result->p99_ms = bench.latency_count ? bench.latencies[(bench.latency_count * 99) / 100] / 1000.0 : 0;
+	result->cpu_seconds = cpu;
+	result->cpu_percent = result->seconds > 0 ? 100 * cpu / result->seconds : 0;
+
+	for (size_t i = 0; i < bench.bucket_count; i++) {
+		Expectation *curr = bench.buckets[i];
+		while (curr) {
+			Expectation *next = curr->hash_next;
+			free(curr->path);
+			free(curr);
+			curr = next;
+		}
+	}
+	for (size_t i = 0; i < bench.dir_count; i++)
+		free(bench.dirs[i]);
+	free(bench.dirs);
+	free(bench.buckets);
+	free(bench.outstanding);
+	free(bench.latencies);
+	return 0;
+}
+
+void print_result(const Result *result) {
+	printf("%-8s %8llu %10.1f %8.2f %10.0f %8.1f %8.1f %8.1f %7.2f %6.0f%%%s\n", result->name, result->ops,
+		   result->bytes / (1024.0 * 1024.0), result->seconds, result->ops_per_sec, result->mb_per_sec,
+		   result->p50_ms, result->p99_ms, result->cpu_seconds, result->cpu_percent,
+		   result->mismatches ? "  TARGET DIFFERS" : "");
+}
+
+// Function to load the results of an earlier run, written with -o. Returns how many were read
+size_t read_baseline(const char *path, Result *results, size_t max_count) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return 0;
+	}
+	char line[512];
+	size_t count = 0;
+	while (count < max_count && fgets(line, sizeof(line), fp)) {
+		Result *r = &results[count];
+		if (sscanf(line, "%31[^,],%llu,%llu,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%zu", r->name, &r->ops, &r->bytes, &r->seconds,
+				   &r->ops_per_sec, &r->mb_per_sec, &r->p50_ms, &r->p99_ms, &r->cpu_seconds, &r->cpu_percent,
+				   &r->mismatches) == 11)
+			count++;
+	}
+	fclose(fp);
+	return count;
+}
+
+// Function to print the change of a number against the baseline, in percent
+void print_change(const char *label, double value, double baseline) {
+	if (baseline > 0)
+		printf(" %s %+.1f%%", label, 100 * (value - baseline) / baseline);
+	else
+		printf(" %s n/a", label);
+}
+
+void usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-n files] [-s scenario[,scenario...]] [-r seed] [-t timeout_s] [-w work_dir] [-o results.csv] "
+			"[-b baseline.csv] [-k] [-- fss_manager options]\n", program);
+	fprintf(stderr, "Scenarios:");
+	for (size_t i = 0; i < SCENARIO_COUNT; i++)
+		fprintf(stderr, " %s (%s)%s", scenarios[i].name, scenarios[i].description, i + 1 < SCENARIO_COUNT ? "," : "\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	int files = 2000;
+	unsigned long long seed = 1;
+	const char *selected = NULL;
+	const char *work_base = NULL;
+	const char *output = NULL;
+	const char *baseline = NULL;
+	int keep = 0;
+
+	setlinebuf(stdout);
+
+	int i = 1;
+	for (; i < argc; i++) {
+		if (!strcmp(argv[i], "--")) {
+			i++;
+			break;
+		}
+		if (!strcmp(argv[i], "-k")) {
+			keep = 1;
+			continue;
+		}
+		if (i + 1 >= argc)
+			usage(argv[0]);
+		if (!strcmp(argv[i], "-n"))
+			files = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-s"))
+			selected = argv[++i];
+		else if (!strcmp(argv[i], "-r"))
+			seed = strtoull(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "-t"))
+			timeout_s = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-w"))
+			work_base = argv[++i];
+		else if (!strcmp(argv[i], "-o"))
+			output = argv[++i];
+		else if (!strcmp(argv[i], "-b"))
+			baseline = argv[++i];
+		else
+			usage(argv[0]);
+	}
+	manager_args = argv + i;
+	manager_arg_count = argc - i;
+	if (files <= 0)
+		usage(argv[0]);
+
+	// fss_manager and worker are the ones built next to this binary
+	char self[PATH_MAX];
+	ssize_t self_len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (self_len <= 0) {
+		perror("/proc/self/exe");
+		exit(EXIT_FAILURE);
+	}
+	self[self_len] = '\0';
+	char *bin_dir = dirname(self);
+	snprintf(manager_path, sizeof(manager_path), "%s/fss_manager", bin_dir);
+	snprintf(worker_path, sizeof(worker_path), "%s/worker", bin_dir);
+	if (access(manager_path, X_OK) == -1 || access(worker_path, X_OK) == -1) {
+		fprintf(stderr, "fss_manager and worker must be built next to %s\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	char work_dir[PATH_MAX];
+	snprintf(work_dir, sizeof(work_dir), "%s/fss_bench.XXXXXX", work_base ? work_base : "/tmp");
+	if (!mkdtemp(work_dir)) {
+		perror(work_dir);
+		exit(EXIT_FAILURE);
+	}
+	for (size_t n = 0; n < sizeof(data); n++)
+		data[n] = 'a' + n % 26;
+
+	Result results[SCENARIO_COUNT];
+	size_t result_count = 0;
+	printf("%-8s %8s %10s %8s %10s %8s %8s %8s %7s %7s\n", "scenario", "ops", "MiB", "seconds", "ops/s", "MiB/s",
+		   "p50 ms", "p99 ms", "cpu s", "cpu");
+	for (size_t s = 0; s < SCENARIO_COUNT; s++) {
+		if (selected) {
+			// Match a whole name of the comma separated list
+			const char *found = strstr(selected, scenarios[s].name);
+			size_t len = strlen(scenarios[s].name);
+			while (found && ((found != selected && found[-1] != ',') || (found[len] && found[len] != ',')))
+				found = strstr(found + 1, scenarios[s].name);
+			if (!found)
+				continue;
+		}
+		char dir[PATH_MAX + 32];
+		snprintf(dir, sizeof(dir), "%s/%s", work_dir, scenarios[s].name);
+		if (run_scenario(&scenarios[s], dir, files, seed, &results[result_count]) == 0)
+			print_result(&results[result_count++]);
+	}
+
+	if (output) {
+		FILE *fp = fopen(output, "w");
+		if (!fp)
+			perror(output);
+		else {
+			fprintf(fp, "scenario,ops,bytes,seconds,ops_per_sec,mib_per_sec,p50_ms,p99_ms,cpu_seconds,cpu_percent,mismatches\n");
+			for (size_t r = 0; r < result_count; r++) {
+				const Result *res = &results[r];
+				fprintf(fp, "%s,%llu,%llu,%.3f,%.1f,%.2f,%.2f,%.2f,%.3f,%.1f,%zu\n", res->name, res->ops, res->bytes,
+						res->seconds, res->ops_per_sec, res->mb_per_sec, res->p50_ms, res->p99_ms, res->cpu_seconds,
+						res->cpu_percent, res->mismatches);
+			}
+			fclose(fp);
+		}
+	}
+
+	if (baseline) {
+		Result base[SCENARIO_COUNT * 2];
+		size_t base_count = read_baseline(baseline, base, SCENARIO_COUNT * 2);
+		printf("\nAgainst %s:\n", baseline);
+		for (size_t r = 0; r < result_count; r++) {
+			for (size_t b = 0; b < base_count; b++) {
+				if (strcmp(results[r].name, base[b].name))
+					continue;
+				printf("%-8s", results[r].name);
+				print_change("ops/s", results[r].ops_per_sec, base[b].ops_per_sec);
+				print_change("MiB/s", results[r].mb_per_sec, base[b].mb_per_sec);
+				print_change("p50", results[r].p50_ms, base[b].p50_ms);
+				print_change("p99", results[r].p99_ms, base[b].p99_ms);
+				print_change("cpu", results[r].cpu_seconds, base[b].cpu_seconds);
+				printf("\n");
+			}
+		}
+	}
+
+	if (keep)
+		printf("Work directory kept: %s\n", work_dir);
+	else
+		nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	int failed = result_count < SCENARIO_COUNT && !selected;
+	for (size_t r = 0; r < result_count; r++)
+		failed |= results[r].mismatches != 0;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,503 @@
+/* File: fss_copy.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "fss_copy.h"
+
+static const char *copy_method_names[COPY_METHOD_COUNT] = {
+	"reflink", "copy_file_range", "sendfile", "read_write", "delta", "io_uring", "mmap", "direct"
+};
+
+static const char *cache_policy_names[CACHE_POLICY_COUNT] = { "keep", "stream", "direct" };
+
+const char *copy_method_name(CopyMethod method) {
+	return method < COPY_METHOD_COUNT ? copy_method_names[method] : "unknown";
+}
+
+const char *cache_policy_name(CachePolicy policy) {
+	return policy < CACHE_POLICY_COUNT ? cache_policy_names[policy] : "unknown";
+}
+
+int cache_policy_parse(const char *name) {
+	for (int i = 0; i < CACHE_POLICY_COUNT; i++) {
+		if (!strcmp(name, cache_policy_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+// Errors that mean the method cannot be used for this pair of files, so the next one should be tried
+static int method_unsupported(int err) {
+	return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV || err == EINVAL ||
+		   err == ENOSYS || err == EBADF || err == EPERM;
+}
+
+// Function to clone the extents of the source. Returns 1 if the method is not usable, 0 on success
+static int copy_with_reflink(int src_fd, int dest_fd, CopyStats *stats) {
+	stats->syscalls++;
+	return ioctl(dest_fd, FICLONE, src_fd) == 0 ? 0 : 1;
+}
+
+// Function to copy with copy_file_range. Returns 1 if the method is not usable, 0 on success, -1 on error
+static int copy_with_file_range(int src_fd, int dest_fd, size_t chunk, CopyStats *stats) {
+	ssize_t bytes;
+	while (stats->syscalls++, (bytes = copy_file_range(src_fd, NULL, dest_fd, NULL, chunk, 0)) > 0)
+		stats->bytes_written += bytes;
+	if (bytes == 0)
+		return 0;
+	return !stats->bytes_written && method_unsupported(errno) ? 1 : -1;
+}
+
+// Function to copy with sendfile. Returns 1 if the method is not usable, 0 on success, -1 on error
+static int copy_with_sendfile(int src_fd, int dest_fd, size_t chunk, CopyStats *stats) {
+	ssize_t bytes;
+	while (stats->syscalls++, (bytes = sendfile(dest_fd, src_fd, NULL, chunk)) > 0)
+		stats->bytes_written += bytes;
+	if (bytes == 0)
+		return 0;
+	return !stats->bytes_written && method_unsupported(errno) ? 1 : -1;
+}
+
+// Function to write a whole buffer at the given offset, or at the current one when offset is -1
+static int write_all(int fd, const char *buf, size_t len, off_t offset, CopyStats *stats) {
+	for (size_t done = 0; done < len; ) {
+		stats->syscalls++;
+		ssize_t written = offset == -1 ? write(fd, buf + done, len - done)
+									   : pwrite(fd, buf + done, len - done, offset + done);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += written;
+	}
+	return 0;
+}
+
+// One buffer per thread, allocated on first use and kept for the next files. It grows when a larger one is asked
+// for, and it is aligned for O_DIRECT
+static char *thread_buffer(size_t size) {
+	static __thread char *buf = NULL;
+	static __thread size_t buf_size = 0;
+	if (buf_size < size) {
+		free(buf);
+		void *aligned;
+		buf = posix_memalign(&aligned, DIRECT_ALIGN, size) == 0 ? aligned : NULL;
+		buf_size = buf ? size : 0;
+	}
+	return buf;
+}
+
+// Function to copy through a user space buffer, the method that always works
+static int copy_with_read_write(int src_fd, int dest_fd, size_t chunk, CopyStats *stats) {
+	char *buf = thread_buffer(chunk);
+	if (!buf)
+		return -1;
+
+	ssize_t bytes;
+	while (stats->syscalls++, (bytes = read(src_fd, buf, chunk)) > 0) {
+		if (write_all(dest_fd, buf, bytes, -1, stats) == -1)
+			return -1;
+		stats->bytes_written += bytes;
+	}
+	return bytes == 0 ? 0 : -1;
+}
+
+// Function to write the target from a mapping of the whole source, chunk bytes per write. Returns 1 if the source
+// cannot be mapped, 0 on success, -1 on error
+static int copy_with_mmap(int src_fd, int dest_fd, size_t chunk, CopyStats *stats) {
+	struct stat st;
+	stats->syscalls++;
+	if (fstat(src_fd, &st) == -1)
+		return -1;
+	if (!st.st_size)
+		return 0;
+	stats->syscalls++;
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+	if (map == MAP_FAILED)
+		return 1;
+	stats->syscalls++;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	int result = 0;
+	for (off_t offset = 0; offset < st.st_size && result == 0; offset += chunk) {
+		size_t len = st.st_size - offset < (off_t)chunk ? (size_t)(st.st_size - offset) : chunk;
+		result = write_all(dest_fd, map + offset, len, -1, stats);
+		if (result == 0)
+			stats->bytes_written += len;
+	}
+	stats->syscalls++;
+	munmap(map, st.st_size);
+	return result;
+}
+
+// Function to copy with O_DIRECT on both files, chunk bytes at a time, so that neither goes through the page cache.
+// The last block is written whole and the target cut to the size of the source afterwards. Returns 1 if the
+// filesystems do not support O_DIRECT, 0 on success, -1 on error
+static int copy_with_direct(int src_fd, int dest_fd, size_t chunk, CopyStats *stats) {
+	chunk = (chunk + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+	char *buf = thread_buffer(chunk);
+	if (!buf)
+		return -1;
+
+	stats->syscalls += 2;
+	int src_flags = fcntl(src_fd, F_GETFL), dest_flags = fcntl(dest_fd, F_GETFL);
+	if (src_flags == -1 || dest_flags == -1)
+		return -1;
+	stats->syscalls += 2;
+	if (fcntl(src_fd, F_SETFL, src_flags | O_DIRECT) == -1 || fcntl(dest_fd, F_SETFL, dest_flags | O_DIRECT) == -1) {
+		stats->syscalls++;
+		fcntl(src_fd, F_SETFL, src_flags);
+		return 1;
+	}
+
+	int result = 0;
+	off_t offset = 0;
+	ssize_t bytes;
+	while (stats->syscalls++, (bytes = pread(src_fd, buf, chunk, offset)) > 0) {
+		size_t len = (bytes + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+		memset(buf + bytes, 0, len - bytes);
+		if (write_all(dest_fd, buf, len, offset, stats) == -1) {
+			result = -1;
+			break;
+		}
+		stats->bytes_written += bytes;
+		offset += bytes;
+
+		// A short read is the end of the source, reading on from an unaligned offset would fail
+		if ((size_t)bytes < chunk)
+			break;
+	}
+	int saved_errno = errno;
+	if (bytes == -1)
+		result = !offset && method_unsupported(errno) ? 1 : -1;
+
+	stats->syscalls += 2;
+	fcntl(src_fd, F_SETFL, src_flags);
+	fcntl(dest_fd, F_SETFL, dest_flags);
+	if (result == 0 && offset % DIRECT_ALIGN) {
+		stats->syscalls++;
+		result = ftruncate(dest_fd, offset);
+		saved_errno = errno;
+	}
+	errno = saved_errno;
+	return result;
+}
+
+// Function to copy up to len bytes at offset with method, switching from copy_file_range to sendfile and then to
+// read/write while none of them could copy anything. Returns the bytes copied, fewer than len only at the end of
+// the source, or -1 on error
+static ssize_t copy_window(int src_fd, int dest_fd, off_t offset, size_t len, CopyMethod *method, CopyStats *stats) {
+	size_t done = 0;
+	while (done < len) {
+		off_t src_offset = offset + done, dest_offset = offset + done;
+		ssize_t bytes;
+		stats->syscalls++;
+		if (*method == COPY_FILE_RANGE) {
+			bytes = copy_file_range(src_fd, &src_offset, dest_fd, &dest_offset, len - done, 0);
+		}
+		else if (*method == COPY_SENDFILE) {
+			// Nothing was written before sendfile, so the offset of the target is the one of the source
+			bytes = sendfile(dest_fd, src_fd, &src_offset, len - done);
+		}
+		else {
+			char *buf = thread_buffer(COPY_BUFFER_SIZE);
+			if (!buf)
+				return -1;
+			bytes = pread(src_fd, buf, len - done < COPY_BUFFER_SIZE ? len - done : COPY_BUFFER_SIZE, src_offset);
+			if (bytes > 0 && write_all(dest_fd, buf, bytes, dest_offset, stats) == -1)
+				return -1;
+		}
+
+		if (bytes == 0)
+			break;
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			if (*method != COPY_READ_WRITE && !stats->bytes_written && method_unsupported(errno)) {
+				*method = *method == COPY_FILE_RANGE ? COPY_SENDFILE : COPY_READ_WRITE;
+				continue;
+			}
+			return -1;
+		}
+		stats->bytes_written += bytes;
+		done += bytes;
+	}
+	return done;
+}
+
+void cache_window_note(CacheWindow *window, int fd, off_t offset, size_t length, int readahead, CopyStats *stats) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	window->offset = offset;
+	window->length = length < STREAM_WINDOW ? length : STREAM_WINDOW;
+	window->pages = 0;
+	if (!window->length)
+		return;
+
+	// Mapping the window without touching it reads nothing, mincore only looks at the cache
+	if (stats)
+		stats->syscalls += 3;
+	void *map = mmap(NULL, window->length, PROT_READ, MAP_SHARED, fd, offset);
+	if (map == MAP_FAILED)
+		return;
+	if (mincore(map, window->length, window->resident) == 0)
+		window->pages = (window->length + page_size - 1) / page_size;
+	munmap(map, window->length);
+
+	if (readahead) {
+		if (stats)
+			stats->syscalls++;
+		posix_fadvise(fd, offset, window->length, POSIX_FADV_WILLNEED);
+	}
+}
+
+void cache_window_drop(const CacheWindow *window, int fd, CopyStats *stats) {
+	if (!window->length)
+		return;
+	if (!window->pages) {
+		if (stats)
+			stats->syscalls++;
+		posix_fadvise(fd, window->offset, window->length, POSIX_FADV_DONTNEED);
+		return;
+	}
+
+	// One call per run of pages that the copy brought in
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	for (size_t page = 0; page < window->pages; ) {
+		if (window->resident[page] & 1) {
+			page++;
+			continue;
+		}
+		size_t first = page;
+		while (page < window->pages && !(window->resident[page] & 1))
+			page++;
+		if (stats)
+			stats->syscalls++;
+		posix_fadvise(fd, window->offset + first * page_size, (page - first) * page_size, POSIX_FADV_DONTNEED);
+	}
+}
+
+// Function to copy STREAM_WINDOW bytes at a time, dropping from the page cache what every window brought in. The
+// readahead of the kernel is turned off for the source, so that it cannot cache pages before they are noted, and
+// the next window is read ahead instead while the current one is copied. The writeback of each window of the target
+// is started once it is copied and waited for one window later, when its pages are clean and can be dropped, so the
+// target holds at most two windows in the cache and none once the copy returns. Returns 0 on success, -1 on error
+static int copy_streaming(int src_fd, int dest_fd, CopyStats *stats) {
+	CopyMethod method = COPY_FILE_RANGE;
+	CacheWindow windows[2];
+	stats->syscalls++;
+	posix_fadvise(src_fd, 0, 0, POSIX_FADV_RANDOM);
+	cache_window_note(&windows[0], src_fd, 0, STREAM_WINDOW, 1, stats);
+
+	off_t offset = 0;
+	ssize_t copied;
+	int current = 0;
+	do {
+		cache_window_note(&windows[!current], src_fd, offset + STREAM_WINDOW, STREAM_WINDOW, 1, stats);
+		if ((copied = copy_window(src_fd, dest_fd, offset, STREAM_WINDOW, &method, stats)) == -1)
+			return -1;
+		if (copied) {
+			cache_window_drop(&windows[current], src_fd, stats);
+			stats->syscalls++;
+			sync_file_range(dest_fd, offset, copied, SYNC_FILE_RANGE_WRITE);
+		}
+		if (offset) {
+			stats->syscalls += 2;
+			sync_file_range(dest_fd, offset - STREAM_WINDOW, STREAM_WINDOW,
+							SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(dest_fd, offset - STREAM_WINDOW, STREAM_WINDOW, POSIX_FADV_DONTNEED);
+		}
+		offset += copied;
+		current = !current;
+	} while (copied == STREAM_WINDOW);
+
+	// The last window is written back at once, a small file waits for its disk write here
+	if (copied) {
+		stats->syscalls += 2;
+		sync_file_range(dest_fd, offset - copied, copied,
+						SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(dest_fd, offset - copied, copied, POSIX_FADV_DONTNEED);
+	}
+	stats->method = method;
+	return 0;
+}
+
+int copy_fd(int src_fd, int dest_fd, CopyStats *stats) {
+	int result;
+	stats->bytes_written = 0;
+	stats->syscalls = 0;
+
+	// Reflink: no data is copied at all
+	if (copy_with_reflink(src_fd, dest_fd, stats) == 0) {
+		stats->method = COPY_REFLINK;
+		return 0;
+	}
+
+	// The failed attempts of a method leave both offsets at the start
+	if ((result = copy_with_file_range(src_fd, dest_fd, COPY_BUFFER_SIZE * 64, stats)) != 1) {
+		stats->method = COPY_FILE_RANGE;
+		return result;
+	}
+	if ((result = copy_with_sendfile(src_fd, dest_fd, COPY_BUFFER_SIZE * 64, stats)) != 1) {
+		stats->method = COPY_SENDFILE;
+		return result;
+	}
+	stats->method = COPY_READ_WRITE;
+	return copy_with_read_write(src_fd, dest_fd, COPY_BUFFER_SIZE, stats);
+}
+
+int copy_fd_cached(int src_fd, int dest_fd, CachePolicy policy, long long direct_min, CopyStats *stats) {
+	if (policy == CACHE_KEEP)
+		return copy_fd(src_fd, dest_fd, stats);
+	stats->bytes_written = 0;
+	stats->syscalls = 0;
+
+	// A reflink reads nothing into the cache
+	if (copy_with_reflink(src_fd, dest_fd, stats) == 0) {
+		stats->method = COPY_REFLINK;
+		return 0;
+	}
+
+	struct stat st;
+	if (policy == CACHE_DIRECT && (stats->syscalls++, fstat(src_fd, &st)) == 0 && st.st_size >= direct_min) {
+		int result = copy_with_direct(src_fd, dest_fd, DIRECT_CHUNK, stats);
+		if (result != 1) {
+			stats->method = COPY_DIRECT;
+			return result;
+		}
+	}
+	return copy_streaming(src_fd, dest_fd, stats);
+}
+
+int copy_fd_with(CopyMethod method, int src_fd, int dest_fd, size_t chunk, CopyStats *stats) {
+	int result;
+	stats->method = method;
+	stats->bytes_written = 0;
+	stats->syscalls = 0;
+	if (!chunk) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	switch (method) {
+	case COPY_REFLINK:
+		result = copy_with_reflink(src_fd, dest_fd, stats);
+		break;
+	case COPY_FILE_RANGE:
+		result = copy_with_file_range(src_fd, dest_fd, chunk, stats);
+		break;
+	case COPY_SENDFILE:
+		result = copy_with_sendfile(src_fd, dest_fd, chunk, stats);
+		break;
+	case COPY_READ_WRITE:
+		result = copy_with_read_write(src_fd, dest_fd, chunk, stats);
+		break;
+	case COPY_MMAP:
+		result = copy_with_mmap(src_fd, dest_fd, chunk, stats);
+		break;
+	case COPY_DIRECT:
+		result = copy_with_direct(src_fd, dest_fd, chunk, stats);
+		break;
+	default:
+		result = 1;
+	}
+	if (result == 1) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return result;
+}
+
+// Function to drop what a delta copy brought into the cache in a window of both files, once the blocks it rewrote
+// in the target are on the disk
+static void release_delta_window(const CacheWindow *src_window, int src_fd, const CacheWindow *dest_window,
+								 int dest_fd, CopyStats *stats) {
+	cache_window_drop(src_window, src_fd, stats);
+	stats->syscalls++;
+	sync_file_range(dest_fd, dest_window->offset, dest_window->length,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	cache_window_drop(dest_window, dest_fd, stats);
+}
+
+int delta_copy_fd(int src_fd, int dest_fd, CachePolicy policy, CopyStats *stats) {
+	stats->bytes_written = 0;
+	stats->syscalls = 0;
+
+	// A reflink is still cheaper than comparing anything
+	if (copy_with_reflink(src_fd, dest_fd, stats) == 0) {
+		stats->method = COPY_REFLINK;
+		return 0;
+	}
+	stats->method = COPY_DELTA;
+
+	// The two halves of the thread buffer hold a source and a target block
+	char *src_buf = thread_buffer(COPY_BUFFER_SIZE);
+	if (!src_buf)
+		return -1;
+	char *dest_buf = src_buf + DELTA_BLOCK_SIZE;
+
+	CacheWindow src_window, dest_window;
+	off_t window_end = 0;
+	int noted = 0;
+	if (policy != CACHE_KEEP) {
+		stats->syscalls += 2;
+		posix_fadvise(src_fd, 0, 0, POSIX_FADV_RANDOM);
+		posix_fadvise(dest_fd, 0, 0, POSIX_FADV_RANDOM);
+	}
+
+	off_t offset = 0;
+	int comparing = 1;
+	ssize_t bytes;
+	while (1) {
+		// Outside of CACHE_KEEP, the cache is noted when a window starts and restored when it ends, the windows being
+		// read ahead by us rather than by the kernel
+		if (policy != CACHE_KEEP && offset >= window_end) {
+			cache_window_note(&src_window, src_fd, offset, STREAM_WINDOW, 1, stats);
+			cache_window_note(&dest_window, dest_fd, offset, STREAM_WINDOW, comparing, stats);
+			window_end = offset + STREAM_WINDOW;
+			noted = 1;
+		}
+		stats->syscalls++;
+		if ((bytes = pread(src_fd, src_buf, DELTA_BLOCK_SIZE, offset)) <= 0)
+			break;
+
+		int differs = 1;
+		if (comparing) {
+			stats->syscalls++;
+			ssize_t dest_bytes = pread(dest_fd, dest_buf, bytes, offset);
+			if (dest_bytes == -1)
+				return -1;
+			differs = dest_bytes != bytes || memcmp(src_buf, dest_buf, bytes);
+		}
+		if (differs) {
+			if (write_all(dest_fd, src_buf, bytes, offset, stats) == -1)
+				return -1;
+			stats->bytes_written += bytes;
+		}
+		offset += bytes;
+		if (noted && offset >= window_end) {
+			release_delta_window(&src_window, src_fd, &dest_window, dest_fd, stats);
+			noted = 0;
+		}
+
+		// When most blocks differ, reading the target costs more than it saves
+		if (comparing && offset >= (off_t)DELTA_PROBE_BLOCKS * DELTA_BLOCK_SIZE && stats->bytes_written * 2 > offset)
+			comparing = 0;
+	}
+	if (bytes == -1)
+		return -1;
+	if (noted)
+		release_delta_window(&src_window, src_fd, &dest_window, dest_fd, stats);
+
+	// Drop whatever the target has beyond the end of the source
+	stats->syscalls++;
+	return ftruncate(dest_fd, offset);
+}
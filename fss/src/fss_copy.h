@@ -0,0 +1,99 @@
+/* File: fss_copy.h */
+#ifndef FSS_COPY_H
+#define FSS_COPY_H
+
+#include <sys/types.h>
+
+// Size of the buffer of the read/write fallback
+#define COPY_BUFFER_SIZE (256 * 1024)
+
+// Blocks compared by the delta copy
+#define DELTA_BLOCK_SIZE (64 * 1024)
+
+// After this many blocks, a delta copy that found more than half of them changed stops comparing
+#define DELTA_PROBE_BLOCKS 16
+
+// Bytes of a file that a streaming copy copies before it drops them from the page cache
+#define STREAM_WINDOW (8 * 1024 * 1024)
+
+// Alignment of the buffer, the offsets and the lengths of an O_DIRECT copy, and the bytes it moves per call
+#define DIRECT_ALIGN 4096
+#define DIRECT_CHUNK (COPY_BUFFER_SIZE * 4)
+
+// Smallest file that the direct cache policy copies with O_DIRECT, unless the pair sets another
+#define DIRECT_MIN_SIZE (64LL * 1024 * 1024)
+
+// Ways to copy a file, from the cheapest to the most expensive
+typedef enum {
+	COPY_REFLINK,       // FICLONE, the target shares the extents of the source (btrfs, xfs)
+	COPY_FILE_RANGE,    // copy_file_range, in-kernel copy that may be offloaded to the storage
+	COPY_SENDFILE,      // sendfile, in-kernel copy through the page cache
+	COPY_READ_WRITE,    // read/write through a user space buffer
+	COPY_DELTA,         // only the blocks that differ are rewritten in an existing target
+	COPY_IO_URING,      // batched reads and writes of many files through io_uring (worker built with IO_URING=1)
+	COPY_MMAP,          // write from a mapping of the source, only used when asked for with copy_fd_with()
+	COPY_DIRECT,        // read/write with O_DIRECT through an aligned buffer, bypassing the page cache
+	COPY_METHOD_COUNT
+} CopyMethod;
+
+// How a copy uses the page cache
+typedef enum {
+	CACHE_KEEP,   // both files stay in the page cache, the fastest when they are read again soon
+	CACHE_STREAM, // the source is read ahead and every copied window of both files is dropped from the cache
+	CACHE_DIRECT, // files of at least direct_min bytes bypass the cache with O_DIRECT, the smaller ones are streamed
+	CACHE_POLICY_COUNT
+} CachePolicy;
+
+typedef struct copy_stats CopyStats;
+
+typedef struct cache_window CacheWindow;
+
+// What a copy did
+struct copy_stats {
+	CopyMethod method;
+	long long bytes_written; // data written to the target, 0 for a reflink
+	long long syscalls;      // system calls the copy made, the attempts of the methods that could not be used included
+};
+
+// Pages of a window of a file that were in the page cache before a copy read it, so that only the pages the
+// copy brought in are dropped afterwards and the ones of the applications using the file stay
+struct cache_window {
+	off_t offset;
+	size_t length;
+	size_t pages;                                // 0 if the residency is unknown
+	unsigned char resident[STREAM_WINDOW / 4096]; // one byte per page, bit 0 set for the cached ones
+};
+
+const char *copy_method_name(CopyMethod method);
+
+// Copy everything from src_fd to the empty dest_fd, trying the cheapest method first.
+// Returns 0 and fills stats, or -1 with errno set
+int copy_fd(int src_fd, int dest_fd, CopyStats *stats);
+
+const char *cache_policy_name(CachePolicy policy);
+
+// Returns the policy called name, -1 if there is none
+int cache_policy_parse(const char *name);
+
+// Copy everything from src_fd to the empty dest_fd like copy_fd(), using the page cache as policy says.
+// Returns 0 and fills stats, or -1 with errno set
+int copy_fd_cached(int src_fd, int dest_fd, CachePolicy policy, long long direct_min, CopyStats *stats);
+
+// Note which pages of the length bytes at offset of fd, at most STREAM_WINDOW, are in the page cache, then start
+// reading them ahead if readahead is set. stats, if not NULL, counts the system calls
+void cache_window_note(CacheWindow *window, int fd, off_t offset, size_t length, int readahead, CopyStats *stats);
+
+// Drop the pages of the window that were not cached when it was noted. Dirty pages are not dropped
+void cache_window_drop(const CacheWindow *window, int fd, CopyStats *stats);
+
+// Copy everything from src_fd to the empty dest_fd with the given method only, chunk bytes at a time: the buffer of
+// read/write, the mapped bytes written at once by mmap, the length asked of every copy_file_range or sendfile call.
+// Returns 0 and fills stats, or -1 with errno set, EOPNOTSUPP when the method cannot copy between these files
+int copy_fd_with(CopyMethod method, int src_fd, int dest_fd, size_t chunk, CopyStats *stats);
+
+// Make the existing dest_fd, opened for reading and writing, identical to src_fd by rewriting only the blocks that
+// differ, keeping out of the page cache what it reads unless policy is CACHE_KEEP. Returns 0 and fills stats, or
+// -1 with errno set
+int delta_copy_fd(int src_fd, int dest_fd, CachePolicy policy, CopyStats *stats);
+
+#endif
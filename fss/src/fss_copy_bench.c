@@ -0,0 +1,277 @@
+/* File: fss_copy_bench.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "fss_copy.h"
+
+// Bytes copied for one measurement: small files are copied many times so that the timing means something
+#define MEASURE_BYTES (32LL * 1024 * 1024)
+#define MAX_COPIES 1024
+
+// Longest list given to an option
+#define MAX_VALUES 16
+
+enum { CACHE_HOT, CACHE_COLD };
+
+static const char *cache_names[] = { "hot", "cold" };
+
+// Methods that can be benchmarked, by the names of copy_method_name()
+static const CopyMethod bench_methods[] = { COPY_READ_WRITE, COPY_FILE_RANGE, COPY_SENDFILE, COPY_MMAP, COPY_DIRECT, COPY_REFLINK };
+
+#define BENCH_METHOD_COUNT (sizeof(bench_methods) / sizeof(bench_methods[0]))
+
+static const char *bench_dir = ".";
+static int fsync_target = 0; // time the fsync of every target too
+
+long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Function to read a size such as 4096, 64K, 16M or 1G. Returns -1 if it is not one
+long long parse_size(const char *str) {
+	char *end;
+	long long value = strtoll(str, &end, 10);
+	if (end == str || value <= 0)
+		return -1;
+	switch (*end) {
+	case 'K': case 'k': value *= 1024; end++; break;
+	case 'M': case 'm': value *= 1024 * 1024; end++; break;
+	case 'G': case 'g': value *= 1024 * 1024 * 1024; end++; break;
+	}
+	return *end ? -1 : value;
+}
+
+// Function to read a comma separated list of sizes. Returns how many were read, -1 if one is not a size
+int parse_sizes(const char *list, long long *values) {
+	char copy[256];
+	snprintf(copy, sizeof(copy), "%s", list);
+	int count = 0;
+	for (char *item = strtok(copy, ","); item && count < MAX_VALUES; item = strtok(NULL, ",")) {
+		if ((values[count++] = parse_size(item)) == -1)
+			return -1;
+	}
+	return count;
+}
+
+// Function to read a comma separated list of names, keeping the index of each in names. Returns how many were
+// read, -1 if one is unknown
+int parse_names(const char *list, const char *(*name_of)(int), int name_count, int *values) {
+	char copy[256];
+	snprintf(copy, sizeof(copy), "%s", list);
+	int count = 0;
+	for (char *item = strtok(copy, ","); item && count < MAX_VALUES; item = strtok(NULL, ",")) {
+		int found = -1;
+		for (int i = 0; i < name_count && found == -1; i++) {
+			if (!strcmp(item, name_of(i)))
+				found = i;
+		}
+		if (found == -1) {
+			fprintf(stderr, "Unknown name: %s\n", item);
+			return -1;
+		}
+		values[count++] = found;
+	}
+	return count;
+}
+
+const char *method_name_at(int index) {
+	return copy_method_name(bench_methods[index]);
+}
+
+const char *cache_name_at(int index) {
+	return cache_names[index];
+}
+
+// Function to create the source file of a size, written to the disk so that dropping it from the cache works
+int make_source(const char *path, long long size) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -1;
+	char buf[64 * 1024];
+	for (size_t i = 0; i < sizeof(buf); i++)
+		buf[i] = (char)(i * 131 + i / 4096);
+	for (long long done = 0; done < size; ) {
+		size_t len = size - done < (long long)sizeof(buf) ? (size_t)(size - done) : sizeof(buf);
+		ssize_t written = write(fd, buf, len);
+		if (written <= 0) {
+			close(fd);
+			return -1;
+		}
+		done += written;
+	}
+	int result = fsync(fd);
+	close(fd);
+	return result;
+}
+
+// Function to bring the whole file into the page cache, or to drop it from there
+void set_cache(const char *path, int cache) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	if (cache == CACHE_COLD) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	else {
+		char buf[64 * 1024];
+		while (read(fd, buf, sizeof(buf)) > 0)
+			;
+	}
+	close(fd);
+}
+
+// Function to copy src to dest the way sync_file() does, with the given method. Returns the nanoseconds it took,
+// or -1 with errno set
+long long timed_copy(const char *src, const char *dest, CopyMethod method, size_t chunk, CopyStats *stats) {
+	struct stat src_stat;
+	long long start = now_ns();
+	int src_fd = open(src, O_RDONLY);
+	if (src_fd == -1)
+		return -1;
+	fstat(src_fd, &src_stat);
+	int dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dest_fd == -1) {
+		close(src_fd);
+		return -1;
+	}
+	int result = copy_fd_with(method, src_fd, dest_fd, chunk, stats);
+	int saved_errno = errno;
+	if (result == 0) {
+		struct timespec times[2] = { src_stat.st_atim, src_stat.st_mtim };
+		futimens(dest_fd, times);
+		if (fsync_target)
+			fsync(dest_fd);
+	}
+	close(src_fd);
+	close(dest_fd);
+	long long elapsed = now_ns() - start;
+	errno = saved_errno;
+	return result == 0 ? elapsed : -1;
+}
+
+int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+void usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-d dir] [-s sizes] [-b buffer_sizes] [-m methods] [-c hot,cold] [-r repeats] [-f] [-o file.csv]\n",
+			program);
+	fprintf(stderr, "Methods:");
+	for (size_t i = 0; i < BENCH_METHOD_COUNT; i++)
+		fprintf(stderr, " %s", method_name_at(i));
+	fprintf(stderr, "\nSizes take a K, M or G suffix, lists are comma separated\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	long long sizes[MAX_VALUES], buffers[MAX_VALUES];
+	int methods[MAX_VALUES], caches[MAX_VALUES];
+	int size_count = parse_sizes("4K,64K,1M,16M,128M", sizes);
+	int buffer_count = parse_sizes("4K,64K,256K,1M,16M", buffers);
+	int method_count = BENCH_METHOD_COUNT;
+	for (int i = 0; i < method_count; i++)
+		methods[i] = i;
+	int cache_count = 2;
+	caches[0] = CACHE_HOT;
+	caches[1] = CACHE_COLD;
+	int repeats = 3;
+	FILE *out = stdout;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "d:s:b:m:c:r:fo:")) != -1) {
+		switch (opt) {
+		case 'd': bench_dir = optarg; break;
+		case 's': size_count = parse_sizes(optarg, sizes); break;
+		case 'b': buffer_count = parse_sizes(optarg, buffers); break;
+		case 'm': method_count = parse_names(optarg, method_name_at, BENCH_METHOD_COUNT, methods); break;
+		case 'c': cache_count = parse_names(optarg, cache_name_at, 2, caches); break;
+		case 'r': repeats = atoi(optarg); break;
+		case 'f': fsync_target = 1; break;
+		case 'o':
+			if (!(out = fopen(optarg, "w"))) {
+				perror(optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default: usage(argv[0]);
+		}
+	}
+	if (size_count <= 0 || buffer_count <= 0 || method_count <= 0 || cache_count <= 0 || repeats <= 0)
+		usage(argv[0]);
+
+	char src[PATH_MAX], dest[PATH_MAX];
+	snprintf(src, sizeof(src), "%s/fss_copy_bench.%d.src", bench_dir, getpid());
+	snprintf(dest, sizeof(dest), "%s/fss_copy_bench.%d.dest", bench_dir, getpid());
+
+	fprintf(out, "method,file_size,buffer_size,cache,fsync,files,mib_per_sec_median,mib_per_sec_min,mib_per_sec_max,"
+			"us_per_file,syscalls_per_file\n");
+	for (int s = 0; s < size_count; s++) {
+		if (make_source(src, sizes[s]) == -1) {
+			perror(src);
+			unlink(src);
+			exit(EXIT_FAILURE);
+		}
+		int copies = MEASURE_BYTES / sizes[s];
+		copies = copies < 1 ? 1 : copies > MAX_COPIES ? MAX_COPIES : copies;
+
+		for (int m = 0; m < method_count; m++) {
+			CopyMethod method = bench_methods[methods[m]];
+			// A reflink copies no data, the buffer size means nothing to it
+			int method_buffers = method == COPY_REFLINK ? 1 : buffer_count;
+			int unsupported = 0;
+			for (int b = 0; b < method_buffers && !unsupported; b++) {
+				for (int c = 0; c < cache_count && !unsupported; c++) {
+					double rates[repeats];
+					long long total_ns = 0, syscalls = 0;
+					int failed = 0;
+					for (int r = 0; r < repeats && !failed; r++) {
+						long long ns = 0;
+						if (caches[c] == CACHE_HOT)
+							set_cache(src, CACHE_HOT);
+						for (int i = 0; i < copies && !failed; i++) {
+							unlink(dest);
+							if (caches[c] == CACHE_COLD)
+								set_cache(src, CACHE_COLD);
+							CopyStats stats;
+							long long elapsed = timed_copy(src, dest, method, buffers[b], &stats);
+							if (elapsed == -1) {
+								fprintf(stderr, "%s, %lld bytes: %s\n", copy_method_name(method), sizes[s], strerror(errno));
+								unsupported = errno == EOPNOTSUPP;
+								failed = 1;
+								break;
+							}
+							ns += elapsed;
+							syscalls += stats.syscalls;
+						}
+						rates[r] = ns ? (double)sizes[s] * copies / (1024 * 1024) / (ns / 1e9) : 0;
+						total_ns += ns;
+					}
+					if (failed)
+						continue;
+
+					qsort(rates, repeats, sizeof(rates[0]), compare_doubles);
+					fprintf(out, "%s,%lld,%lld,%s,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f\n", copy_method_name(method), sizes[s],
+							method == COPY_REFLINK ? 0 : buffers[b], cache_names[caches[c]], fsync_target, copies,
+							rates[repeats / 2], rates[0], rates[repeats - 1],
+							total_ns / 1e3 / ((double)copies * repeats), (double)syscalls / ((double)copies * repeats));
+					fflush(out);
+				}
+			}
+		}
+	}
+	unlink(src);
+	unlink(dest);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
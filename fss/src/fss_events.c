@@ -0,0 +1,384 @@
+/* File: fss_events.c */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fss_events.h"
+
+// Layout of a record in the event log. The log is read on the host that wrote it, so fields keep the native
+// byte order
+struct event_header {
+	uint32_t length;            // of the whole record, header included
+	uint8_t type;
+	uint8_t unused[3];
+	int32_t pid;
+	int64_t timestamp;
+	uint32_t string_lengths[4]; // source, target, operation and result, with their NUL
+};
+
+// The index holds the sources as they were after the first covered bytes of the event log
+struct index_header {
+	char magic[8];
+	uint64_t covered;
+	uint32_t count;
+	uint32_t unused;
+};
+
+struct index_entry {
+	int64_t last_sync;
+	uint8_t monitored;
+	uint8_t unused[3];
+	uint32_t string_lengths[3]; // source, target and result, with their NUL
+};
+
+static const char index_magic[8] = "FSSIDX1";
+
+static int events_fd = -1;
+static char events_path[PATH_MAX];
+static char index_path[PATH_MAX];
+static char *events_buffer = NULL;
+static size_t events_len = 0, events_capacity = 0;
+static long long events_written = 0; // bytes of the event log on disk
+
+// Sources as of every record appended so far, written to the index
+static EventSource *sources = NULL;
+static int index_dirty = 0;
+static time_t index_written_at = 0;
+
+// Function to find the source with the given path in the list, adding it if it is not there
+static EventSource *find_source(EventSource **list, const char *source) {
+	for (EventSource *curr = *list; curr; curr = curr->next) {
+		if (!strcmp(curr->source, source))
+			return curr;
+	}
+	EventSource *entry = calloc(1, sizeof(*entry));
+	entry->source = strdup(source);
+	entry->target = strdup("");
+	entry->result = strdup("");
+	entry->next = *list;
+	*list = entry;
+	return entry;
+}
+
+static void replace_string(char **field, const char *value) {
+	free(*field);
+	*field = strdup(value);
+}
+
+// Function to update the sources with a record, as fss_script.sh does with a line of the text log
+static void apply_record(EventSource **list, const EventRecord *record) {
+	EventSource *entry = find_source(list, record->source);
+	if (record->type == EVENT_SYNC) {
+		replace_string(&entry->target, record->target);
+		replace_string(&entry->result, record->result);
+		entry->last_sync = record->timestamp;
+		entry->monitored = 1;
+	}
+	else if (record->type == EVENT_STOPPED)
+		entry->monitored = 0;
+}
+
+void event_sources_free(EventSource *list) {
+	while (list) {
+		EventSource *next = list->next;
+		free(list->source);
+		free(list->target);
+		free(list->result);
+		free(list);
+		list = next;
+	}
+}
+
+// Function to write the index for the records written so far, replacing the old one at once
+static void write_index(void) {
+	size_t length = sizeof(struct index_header);
+	uint32_t count = 0;
+	for (EventSource *curr = sources; curr; curr = curr->next) {
+		length += sizeof(struct index_entry) + strlen(curr->source) + strlen(curr->target) + strlen(curr->result) + 3;
+		count++;
+	}
+
+	char *buf = malloc(length);
+	if (!buf)
+		return;
+	struct index_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, index_magic, sizeof(header.magic));
+	header.covered = events_written;
+	header.count = count;
+	memcpy(buf, &header, sizeof(header));
+
+	size_t offset = sizeof(header);
+	for (EventSource *curr = sources; curr; curr = curr->next) {
+		const char *strings[3] = { curr->source, curr->target, curr->result };
+		struct index_entry entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.last_sync = curr->last_sync;
+		entry.monitored = curr->monitored;
+		for (int i = 0; i < 3; i++)
+			entry.string_lengths[i] = strlen(strings[i]) + 1;
+		memcpy(buf + offset, &entry, sizeof(entry));
+		offset += sizeof(entry);
+		for (int i = 0; i < 3; i++) {
+			memcpy(buf + offset, strings[i], entry.string_lengths[i]);
+			offset += entry.string_lengths[i];
+		}
+	}
+
+	char tmp_path[PATH_MAX + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd != -1) {
+		ssize_t written = write(fd, buf, length);
+		close(fd);
+		if (written == (ssize_t)length && rename(tmp_path, index_path) == 0) {
+			index_dirty = 0;
+			index_written_at = time(NULL);
+		}
+		else
+			unlink(tmp_path);
+	}
+	free(buf);
+}
+
+int event_log_open(const char *logfile) {
+	if (snprintf(events_path, sizeof(events_path), "%s%s", logfile, EVENT_LOG_SUFFIX) >= (int)sizeof(events_path) ||
+		snprintf(index_path, sizeof(index_path), "%s%s", logfile, EVENT_INDEX_SUFFIX) >= (int)sizeof(index_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	events_fd = open(events_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (events_fd == -1)
+		return -1;
+	events_len = 0;
+	events_written = 0;
+	event_sources_free(sources);
+	sources = NULL;
+	write_index();
+	return 0;
+}
+
+void event_log_append(const EventRecord *record) {
+	if (events_fd == -1)
+		return;
+	const char *strings[4] = { record->source, record->target, record->operation, record->result };
+	struct event_header header;
+	memset(&header, 0, sizeof(header));
+
+	size_t length = sizeof(header);
+	for (int i = 0; i < 4; i++) {
+		if (!strings[i])
+			strings[i] = "";
+		header.string_lengths[i] = strlen(strings[i]) + 1;
+		length += header.string_lengths[i];
+	}
+	if (length > EVENT_MAX_LENGTH)
+		return;
+	header.length = length;
+	header.type = record->type;
+	header.pid = record->pid;
+	header.timestamp = record->timestamp;
+
+	if (events_len + length > events_capacity) {
+		size_t capacity = events_capacity ? events_capacity : 64 * 1024;
+		while (events_len + length > capacity)
+			capacity *= 2;
+		char *grown = realloc(events_buffer, capacity);
+		if (!grown)
+			return;
+		events_buffer = grown;
+		events_capacity = capacity;
+	}
+	memcpy(events_buffer + events_len, &header, sizeof(header));
+	size_t offset = events_len + sizeof(header);
+	for (int i = 0; i < 4; i++) {
+		memcpy(events_buffer + offset, strings[i], header.string_lengths[i]);
+		offset += header.string_lengths[i];
+	}
+	events_len += length;
+
+	apply_record(&sources, record);
+	index_dirty = 1;
+}
+
+void event_log_flush(void) {
+	if (events_fd == -1)
+		return;
+	size_t done = 0;
+	while (done < events_len) {
+		ssize_t written = write(events_fd, events_buffer + done, events_len - done);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			break;
+		done += written;
+	}
+	events_written += done;
+	memmove(events_buffer, events_buffer + done, events_len - done);
+	events_len -= done;
+
+	// The index must not count records that are not on disk yet
+	if (index_dirty && !events_len && time(NULL) - index_written_at >= EVENT_INDEX_INTERVAL)
+		write_index();
+}
+
+void event_log_close(void) {
+	if (events_fd == -1)
+		return;
+	index_written_at = 0;
+	event_log_flush();
+	close(events_fd);
+	events_fd = -1;
+	free(events_buffer);
+	events_buffer = NULL;
+	events_len = events_capacity = 0;
+	event_sources_free(sources);
+	sources = NULL;
+}
+
+ssize_t event_decode(const char *buf, size_t len, EventRecord *record) {
+	struct event_header header;
+	if (len < sizeof(header))
+		return 0;
+	memcpy(&header, buf, sizeof(header));
+	if (header.length < sizeof(header) || header.length > EVENT_MAX_LENGTH)
+		return -1;
+	if (len < header.length)
+		return 0;
+
+	const char *strings[4];
+	size_t offset = sizeof(header);
+	for (int i = 0; i < 4; i++) {
+		uint32_t string_length = header.string_lengths[i];
+		if (!string_length || string_length > header.length - offset || buf[offset + string_length - 1] != '\0')
+			return -1;
+		strings[i] = buf + offset;
+		offset += string_length;
+	}
+	if (offset != header.length)
+		return -1;
+
+	record->type = header.type;
+	record->pid = header.pid;
+	record->timestamp = header.timestamp;
+	record->source = strings[0];
+	record->target = strings[1];
+	record->operation = strings[2];
+	record->result = strings[3];
+	return header.length;
+}
+
+// Function to read the sources of the index file at path. Returns the bytes of the event log it covers, 0 if
+// there is no usable index
+static uint64_t read_index(const char *path, EventSource **list) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	struct stat st;
+	char *buf = NULL;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct index_header) || !(buf = malloc(st.st_size))) {
+		close(fd);
+		return 0;
+	}
+	ssize_t len = read(fd, buf, st.st_size);
+	close(fd);
+
+	struct index_header header;
+	if (len != st.st_size || (memcpy(&header, buf, sizeof(header)), memcmp(header.magic, index_magic, sizeof(header.magic)))) {
+		free(buf);
+		return 0;
+	}
+
+	size_t offset = sizeof(header);
+	for (uint32_t n = 0; n < header.count; n++) {
+		struct index_entry entry;
+		if (len - offset < sizeof(entry))
+			break;
+		memcpy(&entry, buf + offset, sizeof(entry));
+		offset += sizeof(entry);
+
+		const char *strings[3];
+		int valid = 1;
+		for (int i = 0; i < 3 && valid; i++) {
+			uint32_t string_length = entry.string_lengths[i];
+			if (!string_length || string_length > len - offset || buf[offset + string_length - 1] != '\0')
+				valid = 0;
+			else {
+				strings[i] = buf + offset;
+				offset += string_length;
+			}
+		}
+		if (!valid) {
+			// A damaged index is worth nothing, the event log is read from its start instead
+			event_sources_free(*list);
+			*list = NULL;
+			free(buf);
+			return 0;
+		}
+
+		EventSource *source = find_source(list, strings[0]);
+		replace_string(&source->target, strings[1]);
+		replace_string(&source->result, strings[2]);
+		source->last_sync = entry.last_sync;
+		source->monitored = entry.monitored;
+	}
+	free(buf);
+	return header.covered;
+}
+
+int event_log_load(const char *logfile, EventSource **list) {
+	char path[PATH_MAX];
+	*list = NULL;
+
+	if (snprintf(path, sizeof(path), "%s%s", logfile, EVENT_LOG_SUFFIX) >= (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s%s", logfile, EVENT_INDEX_SUFFIX);
+	uint64_t covered = read_index(path, list);
+	if (covered > (uint64_t)st.st_size) {
+		// The index belongs to a log that was emptied since, by a new run of the manager
+		event_sources_free(*list);
+		*list = NULL;
+		covered = 0;
+	}
+
+	// Only the tail the index does not cover is read, mapped from the page that holds its start
+	if (covered < (uint64_t)st.st_size) {
+		long page_size = sysconf(_SC_PAGESIZE);
+		off_t map_start = covered - covered % page_size;
+		size_t map_len = st.st_size - map_start;
+		char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_start);
+		if (map != MAP_FAILED) {
+			const char *buf = map + (covered - map_start);
+			size_t len = st.st_size - covered;
+			EventRecord record;
+			ssize_t consumed;
+			// A record the manager is still writing is left for the next time
+			while ((consumed = event_decode(buf, len, &record)) > 0) {
+				apply_record(list, &record);
+				buf += consumed;
+				len -= consumed;
+			}
+			munmap(map, map_len);
+		}
+	}
+	close(fd);
+	return 0;
+}
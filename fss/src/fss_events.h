@@ -0,0 +1,68 @@
+/* File: fss_events.h */
+#ifndef FSS_EVENTS_H
+#define FSS_EVENTS_H
+
+#include <sys/types.h>
+
+// The binary event log and its index are kept next to the text log, as <log>.events and <log>.idx
+#define EVENT_LOG_SUFFIX ".events"
+#define EVENT_INDEX_SUFFIX ".idx"
+
+// Least seconds between two rewrites of the index while the manager runs
+#define EVENT_INDEX_INTERVAL 1
+
+// Longest record accepted from the event log, anything longer means the file is corrupt
+#define EVENT_MAX_LENGTH (1024 * 1024)
+
+// Kinds of records in the event log
+enum { EVENT_SYNC = 1, EVENT_STOPPED };
+
+typedef struct event_record EventRecord;
+
+// An entry of the event log: the result of a sync operation, or a source that stopped being monitored. On disk it
+// is a length-prefixed header followed by the NUL terminated strings
+struct event_record {
+	int type;              // EVENT_SYNC or EVENT_STOPPED
+	pid_t pid;             // worker of the operation
+	long long timestamp;   // seconds since the epoch
+	const char *source;
+	const char *target;
+	const char *operation;
+	const char *result;    // SUCCESS, PARTIAL or ERROR
+};
+
+typedef struct event_source EventSource;
+
+// What the event log says about a source directory, the same facts fss_script.sh gathers from the text log
+struct event_source {
+	char *source;
+	char *target;
+	char *result;          // of the last sync
+	long long last_sync;   // time of the last sync
+	int monitored;         // synced since it was last stopped
+	EventSource *next;
+};
+
+// Start the event log and the index of the text log at logfile, emptying them. Returns 0, or -1 with errno set
+int event_log_open(const char *logfile);
+
+// Add a record to the event log. Records are kept in memory until event_log_flush()
+void event_log_append(const EventRecord *record);
+
+// Write the buffered records, and the index when it is older than EVENT_INDEX_INTERVAL
+void event_log_flush(void);
+
+// Flush the records, write the index and close the event log
+void event_log_close(void);
+
+// Decode the record at the start of the len bytes of buf. Returns its length, 0 if it is not complete, or -1 if the
+// data is not a valid record. The strings of record point into buf
+ssize_t event_decode(const char *buf, size_t len, EventRecord *record);
+
+// Load the sources of the text log at logfile from the index, and from the records appended after the index was
+// written. Returns 0, or -1 with errno set if there is no event log
+int event_log_load(const char *logfile, EventSource **sources);
+
+void event_sources_free(EventSource *sources);
+
+#endif
@@ -0,0 +1,143 @@
+/* File: fss_fanotify.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include "fss_fanotify.h"
+
+// Events reported for the files and directories of a marked filesystem
+#define FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_CLOSE_WRITE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+
+typedef struct marked_filesystem MarkedFilesystem;
+
+// A marked filesystem, with a directory of it to open the file handles of its events from
+struct marked_filesystem {
+	fsid_t fsid;
+	int mount_fd;
+	MarkedFilesystem *next;
+};
+
+static MarkedFilesystem *marked_filesystems = NULL;
+
+int fanotify_monitor_init(void) {
+	return fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+}
+
+int fanotify_monitor_add(int fd, const char *path) {
+	struct statfs st;
+	if (statfs(path, &st) == -1)
+		return -1;
+	for (MarkedFilesystem *curr = marked_filesystems; curr; curr = curr->next) {
+		if (!memcmp(&curr->fsid, &st.f_fsid, sizeof(st.f_fsid)))
+			return 0;
+	}
+
+	// Only a filesystem mark will do: the kernel refuses FAN_CREATE, FAN_DELETE and the moves on a FAN_MARK_MOUNT
+	// mark (EINVAL), and without them new, deleted and renamed files would go unseen
+	if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, path) == -1)
+		return -1;
+	int mount_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (mount_fd == -1) {
+		int saved_errno = errno;
+		fanotify_mark(fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, path);
+		errno = saved_errno;
+		return -1;
+	}
+
+	MarkedFilesystem *marked = malloc(sizeof(*marked));
+	marked->fsid = st.f_fsid;
+	marked->mount_fd = mount_fd;
+	marked->next = marked_filesystems;
+	marked_filesystems = marked;
+	return 0;
+}
+
+// Function to find the marked filesystem with the given id
+static MarkedFilesystem *find_filesystem(const void *fsid) {
+	for (MarkedFilesystem *curr = marked_filesystems; curr; curr = curr->next) {
+		if (!memcmp(&curr->fsid, fsid, sizeof(curr->fsid)))
+			return curr;
+	}
+	return NULL;
+}
+
+// Function to translate the bits of a fanotify event to the ones inotify uses
+static uint32_t inotify_mask(uint64_t fanotify_mask) {
+	uint32_t mask = 0;
+	if (fanotify_mask & FAN_CREATE)
+		mask |= IN_CREATE;
+	if (fanotify_mask & FAN_DELETE)
+		mask |= IN_DELETE;
+	if (fanotify_mask & FAN_MODIFY)
+		mask |= IN_MODIFY;
+	if (fanotify_mask & FAN_CLOSE_WRITE)
+		mask |= IN_CLOSE_WRITE;
+	if (fanotify_mask & FAN_MOVED_FROM)
+		mask |= IN_MOVED_FROM;
+	if (fanotify_mask & FAN_MOVED_TO)
+		mask |= IN_MOVED_TO;
+	if (fanotify_mask & FAN_ONDIR)
+		mask |= IN_ISDIR;
+	return mask;
+}
+
+void fanotify_monitor_process(const char *buffer, ssize_t len, FanotifyHandler handler, void *arg) {
+	const struct fanotify_event_metadata *meta = (const struct fanotify_event_metadata *)buffer;
+	for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+		if (meta->vers != FANOTIFY_METADATA_VERSION)
+			return;
+		if (meta->mask & FAN_Q_OVERFLOW) {
+			handler(NULL, NULL, IN_Q_OVERFLOW, arg);
+			continue;
+		}
+
+		// The event names the directory by file handle, followed by the name of the file in it
+		const struct fanotify_event_info_fid *fid = (const struct fanotify_event_info_fid *)((const char *)meta + meta->metadata_len);
+		if (meta->event_len < meta->metadata_len + sizeof(*fid) || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+			continue;
+		MarkedFilesystem *filesystem = find_filesystem(&fid->fsid);
+		if (!filesystem)
+			continue;
+		struct file_handle *handle = (struct file_handle *)fid->handle;
+		const char *name = (const char *)handle->f_handle + handle->handle_bytes;
+		if (!strcmp(name, "."))
+			continue;
+
+		// A directory that is gone cannot be opened, nothing of it is left to synchronize
+		int dir_fd = open_by_handle_at(filesystem->mount_fd, handle, O_PATH | O_DIRECTORY);
+		if (dir_fd == -1)
+			continue;
+		char link[32], dir[PATH_MAX];
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+		ssize_t dir_len = readlink(link, dir, sizeof(dir) - 1);
+		const char *deleted = " (deleted)";
+		if (dir_len <= 0 || (dir_len > (ssize_t)strlen(deleted) && !memcmp(dir + dir_len - strlen(deleted), deleted, strlen(deleted)))) {
+			close(dir_fd);
+			continue;
+		}
+		dir[dir_len] = '\0';
+
+		// Events of one file are merged and do not keep their order: whether the file is still there tells if it
+		// was deleted, or moved away, last
+		uint32_t mask = inotify_mask(meta->mask);
+		uint32_t gone = IN_DELETE | IN_MOVED_FROM;
+		if ((mask & gone) && (mask & ~(gone | IN_ISDIR))) {
+			struct stat st;
+			if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+				mask &= ~gone;
+			else
+				mask &= gone | IN_ISDIR;
+		}
+		close(dir_fd);
+
+		handler(dir, name, mask, arg);
+	}
+}
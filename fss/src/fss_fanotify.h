@@ -0,0 +1,28 @@
+/* File: fss_fanotify.h */
+#ifndef FSS_FANOTIFY_H
+#define FSS_FANOTIFY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Bytes of events read at once
+#define FANOTIFY_BUFFER_SIZE (64 * 1024)
+
+// Called for every event with the directory that holds the file, the name of the file and the IN_* bits that
+// inotify would report for it. Moves come without cookies, so their two halves cannot be paired. After an
+// overflow it is called once with IN_Q_OVERFLOW and no paths
+typedef void (*FanotifyHandler)(const char *dir, const char *name, uint32_t mask, void *arg);
+
+// Open a non-blocking fanotify group that reports the changes of files by directory and name. Returns its fd, or
+// -1 with errno set if the kernel does not allow it (e.g. no CAP_SYS_ADMIN, or older than 5.9)
+int fanotify_monitor_init(void);
+
+// Mark the whole filesystem that holds path, once however many paths of it are marked. There is no fallback to a
+// mount mark, which cannot report creations, deletions or moves. Returns 0, or -1 with errno set, e.g. when the
+// filesystem cannot identify its files by handle or the mark is refused in a container
+int fanotify_monitor_add(int fd, const char *path);
+
+// Report the events of the len bytes read from the fanotify fd to handler
+void fanotify_monitor_process(const char *buffer, ssize_t len, FanotifyHandler handler, void *arg);
+
+#endif
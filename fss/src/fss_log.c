@@ -0,0 +1,140 @@
+/* File: fss_log.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "fss_log.h"
+
+// Longest line, longer ones are cut
+#define LOG_LINE_MAX (16 * 1024)
+
+static char *log_path = NULL;
+static int log_fd = -1;
+static long long log_max_bytes = 0;
+static long long log_size = 0;         // bytes in the current file
+static char log_buffer[LOG_BUFFER_SIZE];
+static size_t log_len = 0;
+static unsigned long long log_dropped = 0;
+
+// Formatted time of the current second, computed again only when the second changes
+static time_t stamp_time = -1;
+static char stamp[32];
+static size_t stamp_len;
+
+static int open_log_file(int flags) {
+	log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flags, 0644);
+	log_size = 0;
+	if (log_fd != -1 && !(flags & O_TRUNC))
+		log_size = lseek(log_fd, 0, SEEK_END);
+	return log_fd == -1 ? -1 : 0;
+}
+
+int log_open(const char *path, long long max_bytes) {
+	free(log_path);
+	log_path = strdup(path);
+	log_max_bytes = max_bytes;
+	log_len = 0;
+	log_dropped = 0;
+	return open_log_file(O_TRUNC);
+}
+
+// Function to move the log to <log>.1, shifting the older ones, and start an empty one
+static void rotate_log(void) {
+	char from[PATH_MAX + 16], to[PATH_MAX + 16];
+	for (int i = LOG_KEEP - 1; i >= 1; i--) {
+		snprintf(from, sizeof(from), "%s.%d", log_path, i);
+		snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", log_path);
+	close(log_fd);
+	rename(log_path, to);
+	open_log_file(O_TRUNC);
+}
+
+// Function to refresh the cached time prefix of the lines
+static void update_stamp(void) {
+	time_t now = time(NULL);
+	if (now == stamp_time)
+		return;
+	struct tm t;
+	localtime_r(&now, &t);
+	stamp_len = strftime(stamp, sizeof(stamp), "[%Y-%m-%d %H:%M:%S] ", &t);
+	stamp_time = now;
+}
+
+void log_flush(void) {
+	if (log_fd == -1 || !log_len)
+		return;
+	if (log_max_bytes > 0 && log_size > 0 && log_size + (long long)log_len > log_max_bytes)
+		rotate_log();
+	if (log_fd == -1)
+		return;
+
+	size_t done = 0;
+	while (done < log_len) {
+		ssize_t written = write(log_fd, log_buffer + done, log_len - done);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			break;
+		done += written;
+	}
+	log_size += done;
+	// Whatever could not be written stays for the next flush
+	memmove(log_buffer, log_buffer + done, log_len - done);
+	log_len -= done;
+}
+
+// Function to append text to the buffer, flushing it first if it does not fit. Returns -1 if it still does not
+static int log_append(const char *text, size_t len) {
+	if (log_len + len > sizeof(log_buffer))
+		log_flush();
+	if (log_len + len > sizeof(log_buffer))
+		return -1;
+	memcpy(log_buffer + log_len, text, len);
+	log_len += len;
+	return 0;
+}
+
+void log_printf(const char *format, ...) {
+	char line[LOG_LINE_MAX];
+	update_stamp();
+	memcpy(line, stamp, stamp_len);
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(line + stamp_len, sizeof(line) - stamp_len - 1, format, args);
+	va_end(args);
+	if (len < 0)
+		return;
+	size_t total = stamp_len + len;
+	if (total > sizeof(line) - 2)
+		total = sizeof(line) - 2;
+	line[total++] = '\n';
+
+	if (log_dropped) {
+		// Say how many lines are missing before the first one that makes it
+		char note[96];
+		int note_len = snprintf(note, sizeof(note), "%s%llu log lines dropped\n", stamp, log_dropped);
+		if (log_append(note, note_len) == -1) {
+			log_dropped++;
+			return;
+		}
+		log_dropped = 0;
+	}
+	if (log_append(line, total) == -1)
+		log_dropped++;
+}
+
+void log_close(void) {
+	log_flush();
+	if (log_fd != -1)
+		close(log_fd);
+	log_fd = -1;
+}
@@ -0,0 +1,25 @@
+/* File: fss_log.h */
+#ifndef FSS_LOG_H
+#define FSS_LOG_H
+
+// Bytes of log lines kept in memory between two flushes
+#define LOG_BUFFER_SIZE (1024 * 1024)
+
+// Rotated files kept next to the log, <log>.1 being the newest
+#define LOG_KEEP 3
+
+// Open the log file at path, emptying it. With max_bytes > 0 the file is rotated once it would grow past
+// that size. Returns 0, or -1 with errno set
+int log_open(const char *path, long long max_bytes);
+
+// Add a line to the log, prefixed with the time. Lines are kept in memory until log_flush(); when the buffer is
+// full it is flushed on the spot, and a line that still does not fit is dropped and counted
+void log_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// Write the buffered lines to the file with a single write, rotating it first if needed
+void log_flush(void);
+
+// Flush and close the log
+void log_close(void);
+
+#endif
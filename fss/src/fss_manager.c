@@ -1,4 +1,5 @@
 /* File: fss_manager.c */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,14 +10,73 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <time.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include "fss_protocol.h"
+#include "fss_fanotify.h"
+#include "fss_log.h"
+#include "fss_events.h"
+#include "fss_metrics.h"
+#include "fss_copy.h"
+
+// Events watched in every source directory
+#define WATCH_MASK (IN_CREATE | IN_MODIFY | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO)
+
+// Time an IN_MOVED_FROM waits for the IN_MOVED_TO with its cookie, past it the file left the watched trees
+#define MOVE_WINDOW_MS 50
+
+// Most operations handed to a worker at once
+#define MAX_BATCH_SIZE 64
+
+// Queued operations of a source looked at for one batch, past the ones that have to wait
+#define MAX_BATCH_SCAN (MAX_BATCH_SIZE * 4)
+
+// Priority classes of the queued operations, served in this order
+enum { TASK_INTERACTIVE, TASK_BACKGROUND, TASK_BULK, TASK_PRIORITIES };
+
+// Within a class, small files go first: below 64 KiB, below 1 MiB, below 16 MiB, larger
+#define SIZE_BUCKETS 4
+
+#define TASK_CLASSES (TASK_PRIORITIES * SIZE_BUCKETS)
+
+// Startup synchronization or rescan of a sync pair, see start_reconciliations()
+enum { RECONCILE_DONE, RECONCILE_WAITING, RECONCILE_RUNNING };
+
+// A file keeps coalescing events at most this many quiet windows before it is dispatched anyway
+#define MAX_COALESCE_WINDOWS 10
+
+// Bytes of inotify events read at once, and reads done per wakeup before the other fds get their turn
+#define INOTIFY_BUFFER_SIZE (64 * 1024)
+#define INOTIFY_MAX_READS 16
+
+// Least time between two writes of the metrics file
+#define METRICS_INTERVAL_MS 10000
+
+// Time before the slots whose worker could not be started are tried again
+#define WORKER_RESPAWN_MS 1000
+
+// Names that workers keep at the root of every target directory start with this
+#define MANIFEST_PREFIX ".fss_manifest"
 
 typedef struct sync_info SyncInfo;
 
 typedef struct worker_queue_item WorkerQueueItem;
 
+typedef struct task_source TaskSource;
+
+typedef struct worker_slot WorkerSlot;
+
+typedef struct pending_event PendingEvent;
+
+typedef struct watch_entry WatchEntry;
+
+typedef struct pending_move PendingMove;
+
 struct sync_info {
 	char *source;
 	char *target;
@@ -25,29 +85,171 @@ struct sync_info {
 	time_t last_sync;
 	pid_t last_worker_pid;
 	unsigned int error_count;
-	int worker_pipe_fd;
 	char *last_operation;
+	int weight;      // share of the workers under load, relative to the other pairs
+	int max_workers; // most workers serving the pair at once, 0 for no limit
+	CachePolicy cache_policy; // how the workers copy the files of the pair through the page cache
+	long long direct_min;     // smallest file copied with O_DIRECT under the direct cache policy
+	time_t synced_at; // the target had every change of the source made before this time, 0 if unknown
+	int reconcile;    // RECONCILE_* state of the startup synchronization or rescan
+	unsigned int reconcile_errors; // error_count when the startup synchronization or rescan was requested
+	char *source_path; // canonical source when it is watched through a fanotify mark, NULL under inotify
+	unsigned long long operations;        // operations reported by workers
+	unsigned long long failed_operations; // of them, the ones reported as ERROR
+	unsigned long long files_copied;
+	long long bytes_copied;
+	Histogram latency; // from the first event of a change to the report of its operation
 	SyncInfo *next;
 };
 
+// A queued operation, indexed by (source, filename) so that later operations on the file merge into it
 struct worker_queue_item {
 	char *source;
 	char *target;
 	char *filename;
 	char *operation;
+	char *from;             // old path of a RENAMED, whose filename is the new one; NULL otherwise
+	TaskSource *queue;      // queue of the source directory
+	int task_class;         // priority class and size bucket, see task_class()
+	long long event_ms;     // first event of the change, for the replication latency
+	size_t hash;
+	WorkerQueueItem *hash_next;
+	WorkerQueueItem *prev;
 	WorkerQueueItem *next;
 };
 
+// Operations queued for one source directory, oldest first in each class, and the paths its workers are
+// working on
+struct task_source {
+	char *source;
+	SyncInfo *info;      // sync pair with the weight and the worker quota, NULL if it is gone
+	WorkerQueueItem *heads[TASK_CLASSES];
+	WorkerQueueItem *tails[TASK_CLASSES];
+	size_t queued;
+	int running_batches;
+	double pass;         // service received, in operations divided by the weight
+	unsigned int tried;  // last take_batch() round that looked at the queue
+	char **running;      // paths of the operations in flight, "" for a FULL of the whole source
+	size_t running_count;
+	size_t running_cap;
+	TaskSource *next;
+};
+
+// A long-lived worker process that receives batches of jobs through its stdin and reports through its stdout
+struct worker_slot {
+	pid_t pid;
+	int job_fd;        // write end of the worker's stdin
+	int report_fd;     // read end of the worker's stdout
+	int busy;
+	long long spawned_ms; // start of the worker, one that dies soon after is not replaced at once
+	char *source;      // source directory of the batch in flight
+	size_t batch_size; // operations in the batch in flight
+	TaskSource *queue; // queue the batch came from
+	char **paths;      // paths of the batch, released from queue->running when it is over
+	size_t path_count; // a RENAMED has two paths
+	long long *event_ms; // first event of each operation of the batch, in the order they are reported
+	size_t reported;     // operations of the batch reported so far
+	long long sent_us;   // time the batch was handed to the worker
+	char *report;      // report records received but not yet processed
+	size_t report_len;
+	size_t report_cap;
+};
+
+// A watched directory of a source tree, indexed by its watch descriptor
+struct watch_entry {
+	int wd;
+	SyncInfo *info;
+	char *path; // relative to the source directory, "" for the source itself
+	WatchEntry *hash_next;
+};
+
+// Net effect of the events seen for a file that has not been dispatched yet
+struct pending_event {
+	SyncInfo *info;
+	char *filename;
+	const char *operation; // ADDED, MODIFIED or DELETED
+	int writing;           // modified since the last IN_CLOSE_WRITE, the file may be half written
+	long long first_ms;    // time of the first coalesced event
+	long long last_ms;     // time of the latest event, the quiet window starts here
+	size_t hash;
+	PendingEvent *hash_next;
+	PendingEvent *prev;    // list ordered by last_ms, oldest first
+	PendingEvent *next;
+};
+
+// A file or directory moved away from a watched directory, waiting for the IN_MOVED_TO with its cookie
+struct pending_move {
+	uint32_t cookie;
+	SyncInfo *info;
+	char *filename;
+	int is_dir;
+	long long ms;      // time of the IN_MOVED_FROM
+	PendingMove *next; // oldest first
+};
+
 static SyncInfo *sync_info_mem_store = NULL; // Linked list of sync tasks, each representing a source directory being monitored or processed
-WorkerQueueItem *task_queue = NULL; // Queue for tasks that cannot be processed right now
+// Queues of the tasks that wait for a worker, one per source, and their index by (source, filename)
+static TaskSource *task_sources = NULL;
+static WorkerQueueItem **task_buckets = NULL;
+static size_t task_bucket_count = 0;
+static size_t queued_tasks = 0;
+static unsigned int take_round = 0;
+static WorkerSlot *worker_pool = NULL; // Pool of worker_limit persistent worker processes
+
+// Every watched directory, hashed by watch descriptor
+static WatchEntry **watch_buckets = NULL;
+static size_t watch_bucket_count = 0;
+static size_t watch_count = 0;
+
+// Events waiting for their quiet window, hashed by (sync info, filename)
+static PendingEvent **pending_buckets = NULL;
+static size_t pending_bucket_count = 0;
+static size_t pending_count = 0;
+static PendingEvent *pending_head = NULL, *pending_tail = NULL;
+static PendingMove *pending_moves = NULL;
 
 static int worker_limit = 5;
+static long long respawn_due_ms = 0; // next try of the slots without a worker, 0 when every slot has one
+static int debounce_ms = 200; // quiet window before an event is dispatched
+static int copy_threads = 4;  // parallel copies of a worker during a FULL sync
+static int hash_contents = 0; // workers keep content hashes in the target manifests
+static char *delta_min_size = "8388608"; // smallest file that workers update in place with a delta copy
+static char *slice_files = "1000";       // files a worker copies in one FULL job of a whole tree before yielding
+static char *state_file = NULL;          // sync pair state kept between runs, <config>.state by default
+static int reconcile_limit = 4;          // sync pairs that do their startup synchronization at once
+static int reconciling_pairs = 0;        // sync pairs whose startup synchronization waits or runs
 unsigned int active_workers = 0;
+
+// Counters behind the stats command and the metrics file
+static Histogram latency_histogram;   // from the first event of a change to the report of its operation
+static Histogram operation_histogram; // time a worker took for an operation, as it reports it
+static Histogram batch_histogram;     // from handing a batch to a worker to its aggregate report
+static Histogram spawn_histogram;     // fork of a worker
+static unsigned long long operations_done = 0, operation_errors = 0, files_copied = 0;
+static long long bytes_copied = 0;
+static unsigned long long workers_spawned = 0, worker_crashes = 0;
+static char *metrics_file = NULL;    // Prometheus text file written every METRICS_INTERVAL_MS, none by default
+static long long metrics_written_ms = 0;
 int inotify_fd;
+static time_t inotify_drained_at; // every event of a change made before this time has been read
+static int use_fanotify = 0;       // watch whole filesystems through fanotify marks instead of every directory
+static int fanotify_fd = -1;
+static time_t fanotify_drained_at;
+static int epoll_fd = -1;        // every fd the main loop waits on
+static int worker_epoll_fd = -1; // report pipes of the workers, itself watched by epoll_fd
+static int signal_fd = -1;       // SIGCHLD, read as data instead of handled in signal context
+static sigset_t blocked_signals; // signal mask of the manager before SIGCHLD was blocked, restored for workers
 
 static char *logfile;
+static long long log_max_bytes = 0; // rotate the log past this size, 0 to let it grow
+
+void log_message(const char *message);
+
+long long now_ms();
 
-void log_sync_result(const char *logfile, const char *source, const char *target,
+long long now_us();
+
+void log_sync_result(const char *source, const char *target,
 					 pid_t worker_pid, const char *operation, const char *result,
 					 const char *details);
 
@@ -72,12 +274,24 @@ void create_named_pipes() {
 	}
 }
 
-// Function to clean manager log file from previous execution
-void clean_logs(const char *logfile) {
-	FILE *fp = fopen(logfile, "w");
-	if (!fp)
-		return;
-	fclose(fp); // close the file
+// Function to apply a "key=value" setting of a sync pair: weight=<n>, max_workers=<n>, cache=<keep|stream|direct>
+// or direct_min=<bytes>. Returns -1 if it is unknown
+int apply_pair_option(SyncInfo *info, const char *option) {
+	const char *value = strchr(option, '=');
+	if (!value)
+		return -1;
+	value++;
+	if (!strncmp(option, "weight=", value - option))
+		info->weight = atoi(value) > 0 ? atoi(value) : 1;
+	else if (!strncmp(option, "max_workers=", value - option))
+		info->max_workers = atoi(value) > 0 ? atoi(value) : 0;
+	else if (!strncmp(option, "cache=", value - option) && cache_policy_parse(value) != -1)
+		info->cache_policy = cache_policy_parse(value);
+	else if (!strncmp(option, "direct_min=", value - option))
+		info->direct_min = atoll(value) > 0 ? atoll(value) : 0;
+	else
+		return -1;
+	return 0;
 }
 
 // Function to parse the config data
@@ -86,7 +300,7 @@ void parse_config(const char *filename) {
 	if (!fp)
 		return;
 
-	char line[100];
+	char line[1024];
 
 	while (fgets(line, sizeof(line), fp)) {
 		if (line[0] == '\n' || strspn(line, " \n") == strlen(line))
@@ -109,227 +323,1687 @@ void parse_config(const char *filename) {
         new_node->last_sync = 0;
         new_node->last_worker_pid = -1;
         new_node->error_count = 0;
-        new_node->worker_pipe_fd = -1;
         new_node->last_operation = NULL;
+        new_node->weight = 1;
+        new_node->max_workers = 0;
+        new_node->cache_policy = CACHE_KEEP;
+        new_node->direct_min = DIRECT_MIN_SIZE;
+        new_node->synced_at = 0;
+        new_node->reconcile = RECONCILE_DONE;
+        new_node->reconcile_errors = 0;
+        new_node->source_path = NULL;
+        new_node->operations = new_node->failed_operations = new_node->files_copied = 0;
+        new_node->bytes_copied = 0;
+        memset(&new_node->latency, 0, sizeof(new_node->latency));
         new_node->next = sync_info_mem_store;
         sync_info_mem_store = new_node;
+
+		// Optional key=value settings of the pair follow the directories
+		char *option;
+		while ((option = strtok(NULL, " \n")) != NULL) {
+			if (apply_pair_option(new_node, option) == -1)
+				fprintf(stderr, "Unknown option for %s: %s\n", source, option);
+		}
+	}
+	fclose(fp);
+}
+
+SyncInfo *find_sync_info_by_source(const char *source) {
+	SyncInfo *curr = sync_info_mem_store;
+	while (curr) {
+		if (strcmp(curr->source, source) == 0) {
+			return curr;
+		}
+		curr = curr->next;
+	}
+	return NULL;
+}
+
+// Function to restore the state that the last run of the manager kept for the configured sync pairs. The file is
+// removed once read: a manager that dies before its shutdown leaves no state, and the next run syncs everything
+void load_state(const char *filename) {
+	FILE *fp = fopen(filename, "r");
+	if (!fp)
+		return;
+
+	char line[PATH_MAX * 2 + 128];
+	while (fgets(line, sizeof(line), fp)) {
+		// source, target, synced_at, last_sync, error_count and last_operation, separated by tabs
+		char *source = strtok(line, "\t\n");
+		char *target = strtok(NULL, "\t\n");
+		char *synced_at = strtok(NULL, "\t\n");
+		char *last_sync = strtok(NULL, "\t\n");
+		char *error_count = strtok(NULL, "\t\n");
+		char *last_operation = strtok(NULL, "\t\n");
+		if (!last_operation)
+			continue;
+
+		// The state only counts for the same pair, the config may have changed in between
+		SyncInfo *curr = find_sync_info_by_source(source);
+		if (!curr || strcmp(curr->target, target))
+			continue;
+		curr->synced_at = atoll(synced_at);
+		curr->last_sync = atoll(last_sync);
+		curr->error_count = strtoul(error_count, NULL, 10);
+		if (strcmp(last_operation, "-")) {
+			free(curr->last_operation);
+			curr->last_operation = strdup(last_operation);
+		}
+	}
+	fclose(fp);
+	unlink(filename);
+}
+
+// Function to store the state of every sync pair for the next run. A pair is in sync as of synced_at if it is
+// active, finished its startup synchronization and had no failed operation since then; for the others the next
+// run does a full synchronization
+void save_state(const char *filename, time_t synced_at) {
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", filename);
+	FILE *fp = fopen(tmp_path, "w");
+	if (!fp) {
+		perror("fopen state file");
+		return;
+	}
+
+	for (SyncInfo *curr = sync_info_mem_store; curr; curr = curr->next) {
+		int in_sync = curr->active && curr->reconcile != RECONCILE_WAITING && curr->error_count == curr->reconcile_errors;
+		fprintf(fp, "%s\t%s\t%lld\t%lld\t%u\t%s\n", curr->source, curr->target, in_sync ? (long long)synced_at : 0LL,
+				(long long)curr->last_sync, curr->error_count, curr->last_operation ? curr->last_operation : "-");
+	}
+	// Replace the old state at once, never leave half of it
+	if (fclose(fp) == 0)
+		rename(tmp_path, filename);
+	else
+		unlink(tmp_path);
+}
+
+// Fork and exec a persistent worker connected to the given slot through a job pipe and a report pipe
+int spawn_worker(WorkerSlot *slot) {
+	int job_pipe[2], report_pipe[2];
+
+	// Close-on-exec so that workers do not keep each other's pipes open
+	if (pipe2(job_pipe, O_CLOEXEC) == -1) {
+		perror("pipe");
+		return -1;
+	}
+	if (pipe2(report_pipe, O_CLOEXEC) == -1) {
+		perror("pipe");
+		close(job_pipe[0]);
+		close(job_pipe[1]);
+		return -1;
+	}
+
+	long long fork_start = now_us();
+	pid_t pid = fork();
+	if (pid == 0) {
+		// Child/Worker process: jobs arrive on stdin, reports leave through stdout
+		sigprocmask(SIG_SETMASK, &blocked_signals, NULL);
+		dup2(job_pipe[0], STDIN_FILENO);
+		dup2(report_pipe[1], STDOUT_FILENO);
+
+		char threads[16];
+		snprintf(threads, sizeof(threads), "%d", copy_threads);
+		char *args[] = { "worker", "-t", threads, "-D", delta_min_size, "-S", slice_files, hash_contents ? "-H" : NULL, NULL };
+		execv("./worker", args);
+		perror("execv");
+		exit(EXIT_FAILURE);
+	}
+	else if (pid > 0) {
+		// Parent/Manager process
+		histogram_add(&spawn_histogram, now_us() - fork_start);
+		workers_spawned++;
+		close(job_pipe[0]);
+		close(report_pipe[1]);
+
+		slot->pid = pid;
+		slot->spawned_ms = now_ms();
+		slot->job_fd = job_pipe[1];
+		slot->report_fd = report_pipe[0];
+		slot->busy = 0;
+		slot->source = NULL;
+		slot->event_ms = NULL;
+		slot->report_len = 0;
+
+		// Reports are read as they arrive, without ever blocking the main loop
+		fcntl(slot->report_fd, F_SETFL, fcntl(slot->report_fd, F_GETFL) | O_NONBLOCK);
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = slot };
+		if (epoll_ctl(worker_epoll_fd, EPOLL_CTL_ADD, slot->report_fd, &event) == -1)
+			perror("epoll_ctl");
+		printf("Started worker PID: %d\n", pid);
+		return 0;
+	}
+
+	perror("fork");
+	close(job_pipe[0]);
+	close(job_pipe[1]);
+	close(report_pipe[0]);
+	close(report_pipe[1]);
+	slot->pid = -1;
+	respawn_due_ms = now_ms() + WORKER_RESPAWN_MS;
+	printf("Could not start a worker, trying again in %d ms\n", WORKER_RESPAWN_MS);
+	return -1;
+}
+
+// Start worker_limit persistent workers so that events cost a message instead of a fork/exec
+void start_worker_pool() {
+	if (access("./worker", X_OK) == -1) {
+		perror("./worker");
+		exit(EXIT_FAILURE);
+	}
+
+	worker_pool = calloc(worker_limit, sizeof(*worker_pool));
+	for (int i = 0; i < worker_limit; i++) {
+		spawn_worker(&worker_pool[i]);
+	}
+}
+
+// Close the job pipes so that the workers exit, and collect them
+void stop_worker_pool() {
+	for (int i = 0; i < worker_limit; i++) {
+		WorkerSlot *slot = &worker_pool[i];
+		if (slot->pid <= 0)
+			continue;
+		close(slot->job_fd);
+		waitpid(slot->pid, NULL, 0);
+		epoll_ctl(worker_epoll_fd, EPOLL_CTL_DEL, slot->report_fd, NULL);
+		close(slot->report_fd);
+		free(slot->source);
+		free(slot->report);
+	}
+	free(worker_pool);
+	worker_pool = NULL;
+}
+
+// Number of slots of the pool with a running worker, 0 once the pool is stopped
+int running_workers() {
+	int running = 0;
+	for (int i = 0; worker_pool && i < worker_limit; i++) {
+		if (worker_pool[i].pid > 0)
+			running++;
+	}
+	return running;
+}
+
+// Function to start a worker in the slots left without one, because it could not be started or died too soon, once the
+// retry is due, so that the pool does not stay smaller for the rest of the run
+void respawn_workers(long long now) {
+	if (!respawn_due_ms || now < respawn_due_ms)
+		return;
+	respawn_due_ms = 0;
+	for (int i = 0; i < worker_limit; i++) {
+		if (worker_pool[i].pid <= 0 && !worker_pool[i].busy)
+			spawn_worker(&worker_pool[i]);
+	}
+}
+
+// Milliseconds until the slots without a worker are tried again, -1 when every slot has one
+int respawn_timeout_ms(long long now) {
+	if (!respawn_due_ms)
+		return -1;
+	long long remaining = respawn_due_ms - now;
+	return remaining > 0 ? (int)remaining : 0;
+}
+
+WorkerSlot *find_idle_worker() {
+	for (int i = 0; i < worker_limit; i++) {
+		if (worker_pool[i].pid > 0 && !worker_pool[i].busy)
+			return &worker_pool[i];
+	}
+	return NULL;
+}
+
+void handle_worker_exit(WorkerSlot *slot);
+
+size_t hash_string(const char *str, size_t seed);
+
+const char *merge_operations(const char *first, const char *second);
+
+// Returns 1 for a FULL, or for the RESUME that does the next slice of a FULL of the whole source
+int full_operation(const char *operation) {
+	return !strcmp(operation, "FULL") || !strcmp(operation, "RESUME");
+}
+
+// Function to get the path of the target a task works on, "" for a FULL of the whole source
+const char *task_path(const WorkerQueueItem *task) {
+	return full_operation(task->operation) && !strcmp(task->filename, "ALL") ? "" : task->filename;
+}
+
+// Returns 1 if a and b are the same path or one is inside the other, "" being the whole source
+int paths_overlap(const char *a, const char *b) {
+	size_t a_len = strlen(a), b_len = strlen(b);
+	if (a_len > b_len) {
+		const char *tmp = a; a = b; b = tmp;
+		size_t tmp_len = a_len; a_len = b_len; b_len = tmp_len;
+	}
+	return !a_len || (!strncmp(a, b, a_len) && (b[a_len] == '\0' || b[a_len] == '/'));
+}
+
+// Returns 1 if path is dir or inside it, everything being inside ""
+int path_within(const char *path, const char *dir) {
+	size_t len = strlen(dir);
+	return !len || (!strncmp(path, dir, len) && (path[len] == '\0' || path[len] == '/'));
+}
+
+SyncInfo *find_sync_info_by_source(const char *source);
+
+// Function to find the queue of a source directory, creating it if needed
+TaskSource *find_task_source(const char *source) {
+	TaskSource *curr = task_sources;
+	while (curr) {
+		if (!strcmp(curr->source, source))
+			return curr;
+		curr = curr->next;
+	}
+	curr = calloc(1, sizeof(*curr));
+	curr->source = strdup(source);
+	curr->info = find_sync_info_by_source(source);
+	curr->next = task_sources;
+	task_sources = curr;
+	return curr;
+}
+
+// Function to get the class of an operation: its priority, then the size bucket of the file to copy
+int task_class(const char *source, const char *filename, const char *operation, int priority) {
+	if (priority != TASK_BULK || (strcmp(operation, "ADDED") && strcmp(operation, "MODIFIED")))
+		return priority * SIZE_BUCKETS;
+
+	char path[PATH_MAX];
+	struct stat st;
+	int bucket = 0;
+	snprintf(path, sizeof(path), "%s/%s", source, filename);
+	if (!stat(path, &st)) {
+		for (off_t limit = 64 * 1024; bucket < SIZE_BUCKETS - 1 && st.st_size >= limit; limit *= 16)
+			bucket++;
+	}
+	return priority * SIZE_BUCKETS + bucket;
+}
+
+// Function to append a task at the end of the given class of its queue
+void enqueue_task(WorkerQueueItem *task, int task_class) {
+	TaskSource *queue = task->queue;
+	if (!queue->queued) {
+		// A queue that was idle does not get to catch up on the service it did not use
+		for (TaskSource *curr = task_sources; curr; curr = curr->next) {
+			if (curr != queue && curr->queued && curr->pass > queue->pass)
+				queue->pass = curr->pass;
+		}
+	}
+	task->task_class = task_class;
+	task->prev = queue->tails[task_class];
+	task->next = NULL;
+	if (queue->tails[task_class]) queue->tails[task_class]->next = task;
+	else queue->heads[task_class] = task;
+	queue->tails[task_class] = task;
+	queue->queued++;
+	queued_tasks++;
+}
+
+// Function to take a task out of its class
+void dequeue_task(WorkerQueueItem *task) {
+	TaskSource *queue = task->queue;
+	if (task->prev) task->prev->next = task->next;
+	else queue->heads[task->task_class] = task->next;
+	if (task->next) task->next->prev = task->prev;
+	else queue->tails[task->task_class] = task->prev;
+	queue->queued--;
+	queued_tasks--;
+}
+
+// Function to find the latest queued operation on filename of source
+WorkerQueueItem *find_queued_task(const char *source, const char *filename, size_t hash) {
+	if (!task_bucket_count)
+		return NULL;
+	WorkerQueueItem *curr = task_buckets[hash % task_bucket_count];
+	while (curr) {
+		if (!strcmp(curr->filename, filename) && !strcmp(curr->source, source))
+			return curr;
+		curr = curr->hash_next;
+	}
+	return NULL;
+}
+
+// Function to double the bucket array of the queue index when it gets crowded
+void grow_task_buckets() {
+	size_t count = task_bucket_count ? task_bucket_count * 2 : 256;
+	WorkerQueueItem **buckets = calloc(count, sizeof(*buckets));
+	for (size_t i = 0; i < task_bucket_count; i++) {
+		// Walk each chain from its oldest item, so that the latest one stays first
+		WorkerQueueItem *chain = NULL, *curr = task_buckets[i];
+		while (curr) {
+			WorkerQueueItem *next = curr->hash_next;
+			curr->hash_next = chain;
+			chain = curr;
+			curr = next;
+		}
+		while (chain) {
+			WorkerQueueItem *next = chain->hash_next;
+			chain->hash_next = buckets[chain->hash % count];
+			buckets[chain->hash % count] = chain;
+			chain = next;
+		}
+	}
+	free(task_buckets);
+	task_buckets = buckets;
+	task_bucket_count = count;
+}
+
+// Function to take a task out of its queue and the index, and free it
+void remove_task(WorkerQueueItem *task) {
+	WorkerQueueItem **link = &task_buckets[task->hash % task_bucket_count];
+	while (*link != task)
+		link = &(*link)->hash_next;
+	*link = task->hash_next;
+	dequeue_task(task);
+
+	free(task->source);
+	free(task->target);
+	free(task->filename);
+	free(task->operation);
+	free(task->from);
+	free(task);
+}
+
+// Function to add an operation at the end of the queue of its source, from being the old path of a RENAMED
+void add_task(const char *source, const char *target, const char *filename, const char *operation, const char *from,
+			  int priority) {
+	if (queued_tasks >= task_bucket_count)
+		grow_task_buckets();
+
+	size_t hash = hash_string(filename, hash_string(source, 0));
+	WorkerQueueItem *new_task = malloc(sizeof(*new_task));
+	new_task->source = strdup(source);
+	new_task->target = strdup(target);
+	new_task->filename = strdup(filename);
+	new_task->operation = strdup(operation);
+	new_task->from = from ? strdup(from) : NULL;
+	new_task->queue = find_task_source(source);
+	new_task->event_ms = now_ms();
+	new_task->hash = hash;
+	new_task->hash_next = task_buckets[hash % task_bucket_count];
+	task_buckets[hash % task_bucket_count] = new_task;
+	enqueue_task(new_task, task_class(source, filename, operation, priority));
+
+	if (active_workers >= worker_limit || !find_idle_worker())
+		printf("Worker queue full. Queued operation: %s on %s\n", operation, source);
+}
+
+// Queue an operation of a sync info task with the given priority; dispatch_queued_tasks() hands it to a
+// worker in a batch. An operation on a file that is still queued merges with the queued one instead
+void start_worker_with_operation(const char *source, const char *target, const char *filename, const char *operation,
+								 int priority) {
+	size_t hash = hash_string(filename, hash_string(source, 0));
+	WorkerQueueItem *queued = find_queued_task(source, filename, hash);
+	// A rename has to happen as it is, later operations on the new path go after it
+	if (queued && !queued->from) {
+		int queued_full = full_operation(queued->operation);
+		int full = full_operation(operation);
+		const char *merged = NULL;
+		if (queued_full && full) {
+			// The queued synchronization will see the latest state anyway, and a sliced one goes on rather than
+			// starting over
+			merged = !strcmp(queued->operation, "RESUME") ? queued->operation : operation;
+		}
+		else if (!queued_full && !full) {
+			if (!(merged = merge_operations(queued->operation, operation))) {
+				// Created and deleted before a worker got to it: nothing to do
+				remove_task(queued);
+				return;
+			}
+		}
+		if (merged) {
+			if (strcmp(merged, queued->operation)) {
+				free(queued->operation);
+				queued->operation = strdup(merged);
+			}
+			// The merged task keeps the more urgent priority, and the size the file has now
+			int queued_priority = queued->task_class / SIZE_BUCKETS;
+			int new_class = task_class(source, filename, merged, priority < queued_priority ? priority : queued_priority);
+			if (new_class != queued->task_class) {
+				dequeue_task(queued);
+				enqueue_task(queued, new_class);
+			}
+			return;
+		}
+	}
+
+	add_task(source, target, filename, operation, NULL, priority);
+}
+
+// Function to queue a RENAMED of from to filename, run after everything queued before on either path
+void queue_rename(SyncInfo *info, const char *from, const char *filename) {
+	add_task(info->source, info->target, filename, "RENAMED", from, TASK_BULK);
+}
+
+// Function to write all len bytes of buf to fd
+int write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t written = write(fd, buf, len);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return -1;
+		buf += written;
+		len -= written;
+	}
+	return 0;
+}
+
+// Function to send a batch of operations on one source to an idle worker as a "BATCH" header line, with the cache
+// settings of the pair, followed by one "<operation>\t<filename>" line per operation, with the paths escaped by
+// job_field_write. Returns -1 if the worker is gone
+int send_batch(WorkerSlot *slot, WorkerQueueItem **batch, size_t count) {
+	char *job;
+	size_t len;
+	FILE *stream = open_memstream(&job, &len);
+	if (!stream) {
+		perror("open_memstream");
+		return -1;
+	}
+	SyncInfo *info = batch[0]->queue->info;
+	// Paths are escaped, a tab or newline in a filename would otherwise split or forge job lines
+	fputs("BATCH\t", stream);
+	job_field_write(stream, batch[0]->source);
+	fputc('\t', stream);
+	job_field_write(stream, batch[0]->target);
+	fprintf(stream, "\t%zu\t%s\t%lld\n", count,
+			cache_policy_name(info ? info->cache_policy : CACHE_KEEP), info ? info->direct_min : DIRECT_MIN_SIZE);
+	for (size_t i = 0; i < count; i++) {
+		fprintf(stream, "%s\t", batch[i]->operation);
+		if (batch[i]->from) {
+			job_field_write(stream, batch[i]->from);
+			fputc('\t', stream);
+		}
+		job_field_write(stream, batch[i]->filename);
+		fputc('\n', stream);
+	}
+	fclose(stream);
+
+	int ret = write_all(slot->job_fd, job, len);
+	free(job);
+	if (ret == -1)
+		return -1;
+
+	slot->busy = 1;
+	slot->source = strdup(batch[0]->source);
+	slot->batch_size = count;
+	slot->event_ms = malloc(count * sizeof(*slot->event_ms));
+	for (size_t i = 0; i < count; i++)
+		slot->event_ms[i] = batch[i]->event_ms;
+	slot->reported = 0;
+	slot->sent_us = now_us();
+	active_workers++;
+
+	// Nothing that overlaps these paths may run until the batch is over
+	TaskSource *queue = batch[0]->queue;
+	slot->queue = queue;
+	queue->running_batches++;
+	queue->pass += (double)count / (queue->info && queue->info->weight > 0 ? queue->info->weight : 1);
+	slot->paths = malloc(count * 2 * sizeof(*slot->paths));
+	slot->path_count = 0;
+	if (queue->running_count + count * 2 > queue->running_cap) {
+		queue->running_cap = queue->running_count + count * 2 + 16;
+		queue->running = realloc(queue->running, queue->running_cap * sizeof(*queue->running));
+	}
+	for (size_t i = 0; i < count; i++) {
+		slot->paths[slot->path_count++] = strdup(task_path(batch[i]));
+		if (batch[i]->from)
+			slot->paths[slot->path_count++] = strdup(batch[i]->from);
+	}
+	for (size_t i = 0; i < slot->path_count; i++)
+		queue->running[queue->running_count++] = slot->paths[i];
+	if (count == 1)
+		printf("Worker PID: %d started %s (%s)\n", slot->pid, batch[0]->operation, batch[0]->filename);
+	else
+		printf("Worker PID: %d started batch of %zu operations on %s\n", slot->pid, count, batch[0]->source);
+
+	// Store the worker that serves the source directory
+	SyncInfo *curr = find_sync_info_by_source(batch[0]->source);
+	if (curr) {
+		curr->last_worker_pid = slot->pid;
+		if (curr->last_operation)
+			free(curr->last_operation);
+		curr->last_operation = strdup(batch[count - 1]->operation);
+	}
+	return 0;
+}
+
+// Log and display the report of an operation sent by a worker. Returns -1 for an ERROR report
+int process_worker_report(const ReportRecord *report) {
+	const char *status = report_status_name(report->status);
+	log_sync_result(report->source, report->target,
+					report->pid, report->operation, status, report->details);
+
+	report->status == REPORT_ERROR
+	? display_exec_report(report->source, report->target, report->operation, status, "", report->details)
+	: display_exec_report(report->source, report->target, report->operation, status, report->details, "");
+
+	return report->status == REPORT_ERROR ? -1 : 0;
+}
+
+// Function to count the report of the next operation of the batch in flight on slot in the metrics
+void record_operation(WorkerSlot *slot, SyncInfo *info, const ReportRecord *report) {
+	int failed = report->status == REPORT_ERROR;
+	operations_done++;
+	operation_errors += failed;
+	files_copied += report->files;
+	bytes_copied += report->bytes;
+	histogram_add(&operation_histogram, report->duration_us);
+
+	// A worker reports the operations of a batch in the order they were sent
+	long long latency_us = -1;
+	if (slot->event_ms && slot->reported < slot->batch_size) {
+		latency_us = (now_ms() - slot->event_ms[slot->reported++]) * 1000;
+		histogram_add(&latency_histogram, latency_us);
+	}
+
+	if (!info)
+		return;
+	info->operations++;
+	info->failed_operations += failed;
+	info->files_copied += report->files;
+	info->bytes_copied += report->bytes;
+	if (latency_us != -1)
+		histogram_add(&info->latency, latency_us);
+}
+
+// Function to get the most urgent class with queued operations in queue, TASK_CLASSES if it is empty
+int first_task_class(const TaskSource *queue) {
+	int task_class = 0;
+	while (task_class < TASK_CLASSES && !queue->heads[task_class])
+		task_class++;
+	return task_class;
+}
+
+// Function to pick up to max_count queued operations of one source, most urgent class first and oldest
+// first within a class. The source is the one with the most urgent operation; among equals, the one that
+// received the least service for its weight, so that a noisy pair cannot starve the others. Pairs at their
+// worker quota are passed over. An operation whose path overlaps one in flight, one already in the batch, or
+// one that has to wait before it, is left for a later batch, so each path sees its operations in order while different paths
+// run in parallel. The operations stay queued until remove_task()
+size_t take_batch(WorkerQueueItem **batch, size_t max_count) {
+	take_round++;
+	while (1) {
+		TaskSource *best = NULL;
+		int best_class = TASK_CLASSES;
+		for (TaskSource *curr = task_sources; curr; curr = curr->next) {
+			if (!curr->queued || curr->tried == take_round)
+				continue;
+			if (curr->info && curr->info->max_workers && curr->running_batches >= curr->info->max_workers)
+				continue;
+			int curr_class = first_task_class(curr);
+			if (curr_class < best_class || (curr_class == best_class && curr->pass < best->pass)) {
+				best = curr;
+				best_class = curr_class;
+			}
+		}
+		if (!best)
+			return 0;
+		best->tried = take_round;
+
+		const char *held[MAX_BATCH_SCAN * 2];
+		size_t count = 0, held_count = 0, scanned = 0;
+		for (int task_class = best_class; task_class < TASK_CLASSES; task_class++) {
+			for (WorkerQueueItem *task = best->heads[task_class];
+				 task && count < max_count && scanned < MAX_BATCH_SCAN; task = task->next, scanned++) {
+				// A RENAMED waits for, and holds back, the operations on both of its paths
+				const char *paths[2] = { task_path(task), task->from };
+				int blocked = 0;
+				for (int p = 0; p < 2 && paths[p]; p++) {
+					for (size_t i = 0; i < best->running_count && !blocked; i++)
+						blocked = paths_overlap(paths[p], best->running[i]);
+					for (size_t i = 0; i < held_count && !blocked; i++)
+						blocked = paths_overlap(paths[p], held[i]);
+					// Batches follow class order rather than arrival order, so one never holds two overlapping paths
+					for (size_t i = 0; i < count && !blocked; i++)
+						blocked = paths_overlap(paths[p], task_path(batch[i])) ||
+								  (batch[i]->from && paths_overlap(paths[p], batch[i]->from));
+				}
+				if (blocked) {
+					for (int p = 0; p < 2 && paths[p]; p++)
+						held[held_count++] = paths[p];
+				}
+				else {
+					batch[count++] = task;
+				}
+			}
+		}
+		if (count)
+			return count;
+	}
+}
+
+// If we are able to process tasks in the queue, hand them to idle workers in batches per source
+void dispatch_queued_tasks() {
+	respawn_workers(now_ms());
+	if (!queued_tasks)
+		return;
+
+	// Share the queue between the idle workers instead of giving it all to the first one
+	size_t idle = 0;
+	for (int i = 0; i < worker_limit; i++) {
+		if (worker_pool[i].pid > 0 && !worker_pool[i].busy)
+			idle++;
+	}
+
+	WorkerSlot *slot;
+	while (queued_tasks && idle > 0 && active_workers < worker_limit && (slot = find_idle_worker())) {
+		size_t batch_size = (queued_tasks + idle - 1) / idle;
+		if (batch_size > MAX_BATCH_SIZE)
+			batch_size = MAX_BATCH_SIZE;
+
+		WorkerQueueItem *batch[MAX_BATCH_SIZE];
+		size_t count = take_batch(batch, batch_size);
+		if (!count)
+			break; // everything queued waits for an operation in flight
+		if (send_batch(slot, batch, count) == -1) {
+			// The worker died while idle: replace it, the batch is still queued for the next one
+			perror("write to worker failed");
+			handle_worker_exit(slot);
+			continue;
+		}
+		idle--;
+
+		for (size_t i = 0; i < count; i++)
+			remove_task(batch[i]);
+	}
+}
+
+// Function to update the sync info of a finished batch and free its worker for the next one
+void finish_worker_job(WorkerSlot *slot, int failed) {
+	if (!failed)
+		histogram_add(&batch_histogram, now_us() - slot->sent_us);
+	free(slot->event_ms);
+	slot->event_ms = NULL;
+
+	SyncInfo *curr = find_sync_info_by_source(slot->source);
+	if (curr) {
+		curr->last_sync = time(NULL);
+		if (failed)
+			curr->error_count++;
+		if (curr->last_worker_pid == slot->pid)
+			curr->last_worker_pid = -1;
+	}
+
+	// Release the paths of the batch, the operations waiting on them can go
+	TaskSource *queue = slot->queue;
+	queue->running_batches--;
+	for (size_t i = 0; i < slot->path_count; i++) {
+		for (size_t j = 0; j < queue->running_count; j++) {
+			if (queue->running[j] == slot->paths[i]) {
+				queue->running[j] = queue->running[--queue->running_count];
+				break;
+			}
+		}
+		free(slot->paths[i]);
+	}
+	free(slot->paths);
+	slot->paths = NULL;
+	slot->queue = NULL;
+
+	free(slot->source);
+	slot->source = NULL;
+	slot->busy = 0;
+	active_workers--;
+	printf("Worker %d finished job. Active: %d/%d\n", slot->pid, active_workers, worker_limit);
+}
+
+// Function to replace a worker whose pipes were closed, failing the job it was running
+void handle_worker_exit(WorkerSlot *slot) {
+	close(slot->job_fd);
+	epoll_ctl(worker_epoll_fd, EPOLL_CTL_DEL, slot->report_fd, NULL);
+	close(slot->report_fd);
+	waitpid(slot->pid, NULL, 0);
+	printf("Worker %d exited unexpectedly\n", slot->pid);
+	worker_crashes++;
+
+	pid_t old_pid = slot->pid;
+	char *source = slot->source;
+	int was_busy = slot->busy;
+	long long *event_ms = slot->event_ms;
+
+	// A worker that dies at startup (a failed exec) or while idle would die again straight away, the slot waits for
+	// the periodic retry instead of looping through fork and exit
+	if (!was_busy || now_ms() - slot->spawned_ms < WORKER_RESPAWN_MS) {
+		slot->pid = -1;
+		if (!respawn_due_ms)
+			respawn_due_ms = now_ms() + WORKER_RESPAWN_MS;
+		printf("Starting a new worker in %d ms\n", WORKER_RESPAWN_MS);
+	}
+	else if (spawn_worker(slot) == -1)
+		slot->pid = -1;
+
+	if (was_busy) {
+		// Account for the lost job on the replacement slot
+		slot->busy = 1;
+		slot->source = source;
+		slot->event_ms = event_ms;
+		SyncInfo *curr = find_sync_info_by_source(source);
+		if (curr && curr->last_worker_pid == old_pid)
+			curr->last_worker_pid = slot->pid;
+		finish_worker_job(slot, 1);
+	}
+}
+
+// Function to read what a worker sent and process every complete report record
+void handle_worker_output(WorkerSlot *slot) {
+	// Keep room for a whole pipe buffer; a record longer than that grows the buffer as it arrives
+	if (slot->report_cap - slot->report_len < 4096) {
+		slot->report_cap = slot->report_cap ? slot->report_cap * 2 : 8192;
+		slot->report = realloc(slot->report, slot->report_cap);
+	}
+	ssize_t bytes = read(slot->report_fd, slot->report + slot->report_len, slot->report_cap - slot->report_len);
+	if (bytes == -1 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (bytes <= 0) {
+		handle_worker_exit(slot);
+		return;
+	}
+	slot->report_len += bytes;
+
+	size_t offset = 0;
+	ReportRecord report;
+	ssize_t len;
+	while ((len = report_decode(slot->report + offset, slot->report_len - offset, &report)) > 0) {
+		offset += len;
+		if (report.type == REPORT_BATCH) {
+			// Every operation of the batch has been reported
+			if (slot->busy)
+				finish_worker_job(slot, 0);
+		}
+		else {
+			SyncInfo *curr = slot->source ? find_sync_info_by_source(slot->source) : NULL;
+			record_operation(slot, curr, &report);
+			if (process_worker_report(&report) == -1 && curr)
+				curr->error_count++;
+			// A FULL that did one slice of the tree goes back to the end of the queue for the next one, so
+			// the events that came in meanwhile run first. Only this RESUME goes on from the cursor
+			if (report.more && curr && curr->active)
+				start_worker_with_operation(curr->source, curr->target, "ALL", "RESUME", TASK_BULK);
+		}
+	}
+	if (len == -1) {
+		// Nothing after a corrupt record can be trusted, replace the worker
+		fprintf(stderr, "Invalid report from worker %d\n", slot->pid);
+		slot->report_len = 0;
+		kill(slot->pid, SIGKILL);
+		handle_worker_exit(slot);
+		return;
+	}
+
+	// Keep the incomplete record for the next read
+	slot->report_len -= offset;
+	memmove(slot->report, slot->report + offset, slot->report_len);
+}
+
+// Function to process the reports of the workers that have data, waiting at most timeout_ms for one
+void handle_worker_events(int timeout_ms) {
+	struct epoll_event events[64];
+	int count = epoll_wait(worker_epoll_fd, events, 64, timeout_ms);
+	if (count == -1 && errno != EINTR)
+		perror("epoll_wait");
+	for (int i = 0; i < count; i++)
+		handle_worker_output(events[i].data.ptr);
+}
+
+// Function to keep collecting reports until every worker is idle and the queue is empty
+void wait_for_workers() {
+	while (active_workers > 0 || queued_tasks) {
+		dispatch_queued_tasks();
+		if (active_workers == 0)
+			break;
+		handle_worker_events(-1);
+	}
+}
+
+// Reap the workers that exited; their pipes tell us when one of them is gone
+void reap_workers() {
+	struct signalfd_siginfo info;
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info));
+	while (waitpid(-1, NULL, WNOHANG) > 0);
+}
+
+// Function to add fd to the set of the main loop
+void watch_fd(int fd) {
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Function to create the epoll sets, and to turn SIGCHLD into data on a signalfd
+void setup_event_loop() {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	worker_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1 || worker_epoll_fd == -1) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &blocked_signals);
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd == -1) {
+		perror("signalfd");
+		exit(EXIT_FAILURE);
+	}
+
+	watch_fd(worker_epoll_fd);
+	watch_fd(signal_fd);
+}
+
+void setup_inotify() {
+	// Events are read until the queue is empty, which needs a non-blocking fd
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		perror("inotify_init");
+		exit(EXIT_FAILURE);
+	}
+	inotify_drained_at = time(NULL);
+}
+
+// Function to open the fanotify group, if asked for. Without it every pair is watched through inotify
+void setup_fanotify() {
+	if (!use_fanotify)
+		return;
+	fanotify_fd = fanotify_monitor_init();
+	if (fanotify_fd == -1) {
+		perror("fanotify_init, watching with inotify instead");
+		return;
+	}
+	fanotify_drained_at = time(NULL);
+	watch_fd(fanotify_fd);
+}
+
+// Function to watch the source of a pair through a fanotify mark of its whole filesystem. Returns 0, or -1 if
+// the pair has to be watched through inotify
+int mark_filesystem(SyncInfo *info) {
+	char *source_path = realpath(info->source, NULL);
+	if (!source_path)
+		return -1;
+	if (fanotify_monitor_add(fanotify_fd, source_path) == -1) {
+		fprintf(stderr, "fanotify mark of %s failed, watching it with inotify: %s\n", info->source, strerror(errno));
+		free(source_path);
+		return -1;
+	}
+	info->source_path = source_path;
+	return 0;
+}
+
+WatchEntry *find_watch(int wd) {
+	if (!watch_bucket_count)
+		return NULL;
+	WatchEntry *curr = watch_buckets[(unsigned int)wd % watch_bucket_count];
+	while (curr) {
+		if (curr->wd == wd) {
+			return curr;
+		}
+		curr = curr->hash_next;
+	}
+	return NULL;
+}
+
+// Function to double the bucket array of the watch index when it gets crowded
+void grow_watch_buckets() {
+	size_t count = watch_bucket_count ? watch_bucket_count * 2 : 256;
+	WatchEntry **buckets = calloc(count, sizeof(*buckets));
+	for (size_t i = 0; i < watch_bucket_count; i++) {
+		WatchEntry *curr = watch_buckets[i];
+		while (curr) {
+			WatchEntry *next = curr->hash_next;
+			curr->hash_next = buckets[(unsigned int)curr->wd % count];
+			buckets[(unsigned int)curr->wd % count] = curr;
+			curr = next;
+		}
+	}
+	free(watch_buckets);
+	watch_buckets = buckets;
+	watch_bucket_count = count;
+}
+
+// Function to forget a watch descriptor; the kernel side is removed separately
+void remove_watch_entry(int wd) {
+	if (!watch_bucket_count)
+		return;
+	WatchEntry **link = &watch_buckets[(unsigned int)wd % watch_bucket_count];
+	while (*link) {
+		if ((*link)->wd == wd) {
+			WatchEntry *entry = *link;
+			*link = entry->hash_next;
+			free(entry->path);
+			free(entry);
+			watch_count--;
+			return;
+		}
+		link = &(*link)->hash_next;
+	}
+}
+
+// Function to watch the directory path of a source. Returns its watch descriptor or -1
+int add_watch(SyncInfo *info, const char *path) {
+	if (info->source_path)
+		return 0;
+
+	char full_path[PATH_MAX];
+	if (*path)
+		snprintf(full_path, sizeof(full_path), "%s/%s", info->source, path);
+	else
+		snprintf(full_path, sizeof(full_path), "%s", info->source);
+
+	int wd = inotify_add_watch(inotify_fd, full_path, WATCH_MASK);
+	if (wd == -1)
+		return -1;
+
+	// The same directory may be reached twice, e.g. when it was created during the walk
+	if (!find_watch(wd)) {
+		if (watch_count >= watch_bucket_count)
+			grow_watch_buckets();
+		WatchEntry *entry = malloc(sizeof(*entry));
+		entry->wd = wd;
+		entry->info = info;
+		entry->path = strdup(path);
+		entry->hash_next = watch_buckets[(unsigned int)wd % watch_bucket_count];
+		watch_buckets[(unsigned int)wd % watch_bucket_count] = entry;
+		watch_count++;
+	}
+	return wd;
+}
+
+// Function to watch the directory path of a source and all of its subdirectories.
+// Returns the watch descriptor of path itself or -1
+int add_watch_recursive(SyncInfo *info, const char *path) {
+	// Under a fanotify mark every directory of the tree is covered already
+	if (info->source_path)
+		return 0;
+	if (!*path && fanotify_fd != -1 && mark_filesystem(info) == 0)
+		return 0;
+
+	int wd = add_watch(info, path);
+	if (wd == -1)
+		return -1;
+
+	char full_path[PATH_MAX];
+	if (*path)
+		snprintf(full_path, sizeof(full_path), "%s/%s", info->source, path);
+	else
+		snprintf(full_path, sizeof(full_path), "%s", info->source);
+
+	DIR *dir = opendir(full_path);
+	if (!dir)
+		return wd;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		char sub_path[PATH_MAX];
+		if (*path)
+			snprintf(sub_path, sizeof(sub_path), "%s/%s", path, entry->d_name);
+		else
+			snprintf(sub_path, sizeof(sub_path), "%s", entry->d_name);
+
+		int is_dir = entry->d_type == DT_DIR;
+		if (entry->d_type == DT_UNKNOWN) {
+			// Some filesystems do not fill d_type; symbolic links are never followed
+			char entry_path[PATH_MAX];
+			struct stat st;
+			is_dir = snprintf(entry_path, sizeof(entry_path), "%s/%s", full_path, entry->d_name) < (int)sizeof(entry_path) &&
+					 !lstat(entry_path, &st) && S_ISDIR(st.st_mode);
+		}
+		if (is_dir)
+			add_watch_recursive(info, sub_path);
+	}
+	closedir(dir);
+	return wd;
+}
+
+void remove_watches_below(SyncInfo *info, const char *path);
+
+// Function to stop watching every directory of a source tree
+void remove_watches(SyncInfo *info) {
+	// The fanotify mark stays for the other pairs of the filesystem, events are no longer matched to this one
+	free(info->source_path);
+	info->source_path = NULL;
+
+	remove_watches_below(info, "");
+	info->wd = -1;
+}
+
+// Function to stop watching the directory path of a source tree and the directories below it
+void remove_watches_below(SyncInfo *info, const char *path) {
+	for (size_t i = 0; i < watch_bucket_count; i++) {
+		WatchEntry **link = &watch_buckets[i];
+		while (*link) {
+			WatchEntry *entry = *link;
+			if (entry->info == info && path_within(entry->path, path)) {
+				inotify_rm_watch(inotify_fd, entry->wd);
+				*link = entry->hash_next;
+				free(entry->path);
+				free(entry);
+				watch_count--;
+			}
+			else {
+				link = &entry->hash_next;
+			}
+		}
+	}
+}
+
+// Function to give the watches of a directory that was renamed, and of the directories below it, their new paths
+void rename_watches(SyncInfo *info, const char *from, const char *to) {
+	size_t from_len = strlen(from);
+	for (size_t i = 0; i < watch_bucket_count; i++) {
+		for (WatchEntry *entry = watch_buckets[i]; entry; entry = entry->hash_next) {
+			if (entry->info != info || !*from || !path_within(entry->path, from))
+				continue;
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s%s", to, entry->path + from_len);
+			free(entry->path);
+			entry->path = strdup(path);
+		}
+	}
+}
+
+// Function to free the watch index
+void free_watches() {
+	for (size_t i = 0; i < watch_bucket_count; i++) {
+		WatchEntry *curr = watch_buckets[i];
+		while (curr) {
+			WatchEntry *next = curr->hash_next;
+			free(curr->path);
+			free(curr);
+			curr = next;
+		}
+	}
+	free(watch_buckets);
+	watch_buckets = NULL;
+	watch_bucket_count = watch_count = 0;
+}
+
+// Function to queue the deletion of the entries that the target directory path has and the source does not
+void queue_deletions(SyncInfo *info, const char *path, const char *full_path, const char *target_path) {
+	DIR *dir = opendir(target_path);
+	if (!dir)
+		return;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		if (!*path && !strncmp(entry->d_name, MANIFEST_PREFIX, strlen(MANIFEST_PREFIX)))
+			continue;
+
+		char sub_path[PATH_MAX], entry_path[PATH_MAX];
+		struct stat st;
+		snprintf(sub_path, sizeof(sub_path), "%s%s%s", path, *path ? "/" : "", entry->d_name);
+		if (snprintf(entry_path, sizeof(entry_path), "%s/%s", full_path, entry->d_name) < (int)sizeof(entry_path) &&
+			lstat(entry_path, &st) == -1 && errno == ENOENT)
+			start_worker_with_operation(info->source, info->target, sub_path, "DELETED", TASK_BACKGROUND);
+	}
+	closedir(dir);
+}
+
+// Function to queue what changed in a source tree since the pair was last in sync: the files whose status
+// changed after since, as a FULL each directory that the target does not have yet, and the deletion of what
+// the target has and the changed directories no longer have. The status change time cannot be set back, unlike
+// the modification time that e.g. tar restores. Changed directories are watched again, in case their watch
+// was never added
+void queue_changes_since(SyncInfo *info, const char *path, time_t since) {
+	char full_path[PATH_MAX], target_path[PATH_MAX];
+	snprintf(full_path, sizeof(full_path), "%s%s%s", info->source, *path ? "/" : "", path);
+	snprintf(target_path, sizeof(target_path), "%s%s%s", info->target, *path ? "/" : "", path);
+
+	struct stat st;
+	if (stat(target_path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		add_watch_recursive(info, path);
+		start_worker_with_operation(info->source, info->target, *path ? path : "ALL", "FULL", TASK_BACKGROUND);
+		return;
+	}
+	if (lstat(full_path, &st) == -1)
+		return;
+	if (st.st_ctime >= since || st.st_mtime >= since) {
+		add_watch(info, path);
+		queue_deletions(info, path, full_path, target_path);
+	}
+
+	DIR *dir = opendir(full_path);
+	if (!dir)
+		return;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		char sub_path[PATH_MAX], entry_path[PATH_MAX];
+		snprintf(sub_path, sizeof(sub_path), "%s%s%s", path, *path ? "/" : "", entry->d_name);
+		if (snprintf(entry_path, sizeof(entry_path), "%s/%s", full_path, entry->d_name) >= (int)sizeof(entry_path) ||
+			lstat(entry_path, &st) == -1)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+			queue_changes_since(info, sub_path, since);
+		else if (S_ISREG(st.st_mode) && (st.st_ctime >= since || st.st_mtime >= since))
+			start_worker_with_operation(info->source, info->target, sub_path, "MODIFIED", TASK_BACKGROUND);
 	}
-	fclose(fp);
+	closedir(dir);
 }
 
-// Start worker for a specific operation in sync info task
-void start_worker_with_operation(const char *source, const char *target, const char *filename, const char *operation) {
-	if (active_workers >= worker_limit) {
-		// If number of active workers exceeds the limit, add the sync task in the queue
-		WorkerQueueItem *new_task = malloc(sizeof(*new_task));
-		new_task->source = strdup(source);
-		new_task->target = strdup(target);
-		new_task->filename = strdup(filename);
-		new_task->operation = strdup(operation);
-		new_task->next = task_queue;
-		task_queue = new_task;
-		printf("Worker queue full. Queued operation: %s on %s\n", operation, source);
-		return;
+// Function to check if nothing of a source is queued or in flight
+int source_idle(const char *source) {
+	for (TaskSource *curr = task_sources; curr; curr = curr->next) {
+		if (!strcmp(curr->source, source))
+			return !curr->queued && !curr->running_batches;
 	}
+	return 1;
+}
 
-	// Create pipe for worker/manager communication
-	int worker_pipe[2];
-	if (pipe(worker_pipe) == -1) {
-		perror("pipe");
+// Function to start the startup synchronization or the rescan of the waiting sync pairs, at most reconcile_limit
+// at a time so that a restart with many pairs does not flood the disks. A pair with a time up to which it was in
+// sync only gets what changed since then, the others a full synchronization
+void start_reconciliations() {
+	if (!reconciling_pairs)
 		return;
+
+	int running = 0;
+	for (SyncInfo *curr = sync_info_mem_store; curr; curr = curr->next) {
+		if (curr->reconcile != RECONCILE_RUNNING)
+			continue;
+		if (source_idle(curr->source)) {
+			curr->reconcile = RECONCILE_DONE;
+			reconciling_pairs--;
+			printf("Reconciled %s\n", curr->source);
+		}
+		else {
+			running++;
+		}
 	}
 
-	pid_t pid = fork();
-	if (pid == 0) {
-		// Child/Worker process
+	for (SyncInfo *curr = sync_info_mem_store; curr && running < reconcile_limit; curr = curr->next) {
+		if (curr->reconcile != RECONCILE_WAITING)
+			continue;
+		curr->reconcile = RECONCILE_RUNNING;
+		running++;
+
+		char log_buffer[PATH_MAX + 100];
+		if (curr->synced_at) {
+			char since[20];
+			strftime(since, sizeof(since), "%Y-%m-%d %H:%M:%S", localtime(&curr->synced_at));
+			snprintf(log_buffer, sizeof(log_buffer), "Reconciling %s with changes since %s", curr->source, since);
+			queue_changes_since(curr, "", curr->synced_at);
+		}
+		else {
+			snprintf(log_buffer, sizeof(log_buffer), "Full synchronization of %s", curr->source);
+			start_worker_with_operation(curr->source, curr->target, "ALL", "FULL", TASK_BACKGROUND);
+		}
+		log_message(log_buffer);
+	}
+}
+
+// Function to rescan every active sync pair for the changes made since the event queue was last drained,
+// after the kernel dropped events because the queue overflowed. The overflow does not tell which directories
+// lost events, but a rescan only queues what changed in that time
+void schedule_rescans(time_t since) {
+	char since_time[20], log_buffer[100];
+	strftime(since_time, sizeof(since_time), "%Y-%m-%d %H:%M:%S", localtime(&since));
+	snprintf(log_buffer, sizeof(log_buffer), "Event queue overflow, rescanning changes since %s", since_time);
+	log_message(log_buffer);
+	printf("%s\n", log_buffer);
+
+	for (SyncInfo *curr = sync_info_mem_store; curr; curr = curr->next) {
+		if (!curr->active)
+			continue;
+		if (curr->reconcile == RECONCILE_WAITING) {
+			// Not started yet, it covers the lost events if it goes back far enough
+			if (curr->synced_at > since)
+				curr->synced_at = since;
+			continue;
+		}
+		if (curr->reconcile == RECONCILE_DONE) {
+			curr->reconcile_errors = curr->error_count;
+			reconciling_pairs++;
+		}
+		// A pair whose walk is over already has to look again
+		curr->synced_at = since;
+		curr->reconcile = RECONCILE_WAITING;
+	}
+}
 
-		close(worker_pipe[0]); // Close read end
+// Monotonic clock in milliseconds, used for the quiet windows
+long long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-		// Redirect stdout to pipe
-		dup2(worker_pipe[1], STDOUT_FILENO);
-		close(worker_pipe[1]);
+// Monotonic clock in microseconds, for the timings that are too short for now_ms()
+long long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-		// Execute worker in the clone that fork created
-		execl("./worker", "worker", source, target, filename, operation, NULL);
-		perror("execl");
-		exit(EXIT_FAILURE);
+// FNV-1a hash of a string, mixed with a seed
+size_t hash_string(const char *str, size_t seed) {
+	size_t hash = 14695981039346656037ULL ^ seed;
+	for (; *str; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 1099511628211ULL;
 	}
-	else if (pid > 0) {
-		// Parent/Manager process
+	return hash;
+}
 
-		close(worker_pipe[1]); // Close write end
+// Function to combine two operations on the same file into their net effect, NULL if they cancel out
+const char *merge_operations(const char *first, const char *second) {
+	if (!strcmp(second, "DELETED"))
+		return strcmp(first, "ADDED") ? "DELETED" : NULL; // created and deleted: nothing to do
+	if (!strcmp(first, "ADDED"))
+		return "ADDED";
+	return "MODIFIED"; // modified again, or deleted and created again
+}
 
-		active_workers++;
-		printf("Started worker PID: %d for %s (%s)\n", pid, operation, filename);
+PendingEvent *find_pending_event(SyncInfo *info, const char *filename, size_t hash) {
+	if (!pending_bucket_count)
+		return NULL;
+	PendingEvent *curr = pending_buckets[hash % pending_bucket_count];
+	while (curr) {
+		if (curr->info == info && !strcmp(curr->filename, filename))
+			return curr;
+		curr = curr->hash_next;
+	}
+	return NULL;
+}
 
-		SyncInfo *curr = sync_info_mem_store;
+// Function to double the bucket array when the table gets crowded
+void grow_pending_buckets() {
+	size_t count = pending_bucket_count ? pending_bucket_count * 2 : 256;
+	PendingEvent **buckets = calloc(count, sizeof(*buckets));
+	for (size_t i = 0; i < pending_bucket_count; i++) {
+		PendingEvent *curr = pending_buckets[i];
 		while (curr) {
-			// Search for the worker to store the pipe file descriptor
-			if (strcmp(curr->source, source) == 0) {
-				curr->last_worker_pid = pid;
-				curr->worker_pipe_fd = worker_pipe[0];
-				if (curr->last_operation)
-					free(curr->last_operation);
-				curr->last_operation = strdup(operation);
-				break;
-			}
-			curr = curr->next;
+			PendingEvent *next = curr->hash_next;
+			curr->hash_next = buckets[curr->hash % count];
+			buckets[curr->hash % count] = curr;
+			curr = next;
 		}
 	}
-	else {
-		perror("fork");
-		close(worker_pipe[0]);
-		close(worker_pipe[1]);
-	}
+	free(pending_buckets);
+	pending_buckets = buckets;
+	pending_bucket_count = count;
 }
 
-// Read the report which was printed in the stdout of the worker
-void process_worker_report(const char *report, pid_t worker_pid) {
-	char *worker_tag = strstr(report, "[WORKER_REPORT]");
-	if (worker_tag) {
-		char timestamp[50], source_dir[50], target_dir[50];
-		char operation[20], status[20], details[300];
+void unlink_pending_event(PendingEvent *event) {
+	PendingEvent **link = &pending_buckets[event->hash % pending_bucket_count];
+	while (*link != event)
+		link = &(*link)->hash_next;
+	*link = event->hash_next;
+
+	if (event->prev) event->prev->next = event->next;
+	else pending_head = event->next;
+	if (event->next) event->next->prev = event->prev;
+	else pending_tail = event->prev;
+	pending_count--;
+}
 
-		if (sscanf(report, "[%[^]]] [%*[^]]] [%[^]]] [%[^]]] [%*d] [%[^]]] [%[^]]] [%[^]]]",
-			timestamp, source_dir, target_dir, operation, status, details) >= 5) {
+// Function to dispatch the net operation of a pending event and forget it
+void flush_pending_event(PendingEvent *event) {
+	unlink_pending_event(event);
+	start_worker_with_operation(event->info->source, event->info->target, event->filename, event->operation, TASK_BULK);
+
+	// The replication latency of the change counts from its first event, not from the end of the quiet window
+	const char *source = event->info->source;
+	WorkerQueueItem *task = find_queued_task(source, event->filename, hash_string(event->filename, hash_string(source, 0)));
+	if (task && event->first_ms < task->event_ms)
+		task->event_ms = event->first_ms;
+	free(event->filename);
+	free(event);
+}
 
-			log_sync_result(logfile, source_dir, target_dir,
-							worker_pid, operation, status, details);
+void move_pending_event_to_tail(PendingEvent *event) {
+	if (event == pending_tail)
+		return;
+	if (event->prev) event->prev->next = event->next;
+	else pending_head = event->next;
+	event->next->prev = event->prev;
+	event->prev = pending_tail;
+	event->next = NULL;
+	pending_tail->next = event;
+	pending_tail = event;
+}
 
-			!strcmp(status, "ERROR")
-			? display_exec_report(source_dir, target_dir, operation, status, "", details)
-			: display_exec_report(source_dir, target_dir, operation, status, details, "");
+// Function to dispatch every event whose quiet window has passed
+void flush_expired_events(long long now) {
+	while (pending_head && now - pending_head->last_ms >= debounce_ms) {
+		PendingEvent *event = pending_head;
+		if (event->writing && now - event->first_ms < (long long)debounce_ms * MAX_COALESCE_WINDOWS) {
+			// Still open for writing: give the writer another window
+			event->last_ms = now;
+			move_pending_event_to_tail(event);
+			continue;
 		}
+		flush_pending_event(event);
 	}
 }
 
-// Function to handle cleanup and task management when worker processes exit 
-void sigchld_handler(int sig) {
-	int status;
-	pid_t pid;
-	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-		SyncInfo *curr = sync_info_mem_store;
-		while (curr) {
-			if (curr->last_worker_pid == pid) {
-				// Read remaining data from pipe
-				if (curr->worker_pipe_fd > 0) {
-					char report[1000];
-					ssize_t bytes;
-					while ((bytes = read(curr->worker_pipe_fd, report, sizeof(report) - 1)) > 0) {
-						report[bytes] = '\0';
-						process_worker_report(report, pid);
-					}
-					close(curr->worker_pipe_fd);
-				}
+void flush_all_pending_events() {
+	while (pending_head)
+		flush_pending_event(pending_head);
+}
 
-				// Update sync info
-				curr->last_sync = time(NULL);
-				if (!WIFEXITED(status) || WEXITSTATUS(status))
-					curr->error_count++;
-				curr->last_worker_pid = -1;
-				break;
-			}
-			curr = curr->next;
+// Milliseconds until the oldest pending event expires, -1 when there is nothing pending
+int pending_timeout_ms(long long now) {
+	if (!pending_head && !pending_moves)
+		return -1;
+	long long remaining = pending_head ? pending_head->last_ms + debounce_ms - now : MOVE_WINDOW_MS;
+	if (pending_moves && pending_moves->ms + MOVE_WINDOW_MS - now < remaining)
+		remaining = pending_moves->ms + MOVE_WINDOW_MS - now;
+	return remaining > 0 ? (int)remaining : 0;
+}
+
+// Function to coalesce an inotify event with the pending events of the same file. The net operation
+// is dispatched once the file has been quiet for debounce_ms and is no longer open for writing
+void coalesce_event(SyncInfo *info, const char *filename, const char *operation, int closed_write, long long now) {
+	size_t hash = hash_string(filename, (size_t)info);
+	PendingEvent *event = find_pending_event(info, filename, hash);
+
+	if (!event) {
+		if (pending_count >= pending_bucket_count)
+			grow_pending_buckets();
+		event = malloc(sizeof(*event));
+		event->info = info;
+		event->filename = strdup(filename);
+		event->operation = operation;
+		event->first_ms = now;
+		event->hash = hash;
+		event->hash_next = pending_buckets[hash % pending_bucket_count];
+		pending_buckets[hash % pending_bucket_count] = event;
+		event->prev = pending_tail;
+		event->next = NULL;
+		if (pending_tail) pending_tail->next = event;
+		else pending_head = event;
+		pending_tail = event;
+		pending_count++;
+	}
+	else {
+		const char *merged = merge_operations(event->operation, operation);
+		if (!merged) {
+			// The file came and went within the window
+			unlink_pending_event(event);
+			free(event->filename);
+			free(event);
+			return;
 		}
+		event->operation = merged;
 
-		active_workers--;
-		printf("Worker %d exited. Active: %d/%d\n", pid, active_workers, worker_limit);
+		// The list stays ordered by the last event time
+		move_pending_event_to_tail(event);
+	}
+	event->last_ms = now;
+	event->writing = strcmp(operation, "DELETED") && !closed_write;
 
-		// If we are able to process tasks in the queue, start workers to sync them
-		while (task_queue && active_workers < worker_limit) {
-			WorkerQueueItem *task = task_queue;
-			task_queue = task_queue->next;
+	// A file that keeps changing is dispatched anyway once it is too old
+	if (now - event->first_ms >= (long long)debounce_ms * MAX_COALESCE_WINDOWS)
+		flush_pending_event(event);
+}
 
-			start_worker_with_operation(task->source, task->target, task->filename, task->operation);
+// Function to settle what waits for path, or for anything below it, before path moves away: deletions are queued
+// now, so that they go before the move, and copies are dropped since their source is gone. Returns 1 if copies
+// were dropped
+int settle_moved_changes(SyncInfo *info, const char *path) {
+	int dropped = 0;
+	PendingEvent *event = pending_head;
+	while (event) {
+		PendingEvent *next = event->next;
+		if (event->info == info && path_within(event->filename, path)) {
+			if (!strcmp(event->operation, "DELETED")) {
+				flush_pending_event(event);
+			}
+			else {
+				unlink_pending_event(event);
+				free(event->filename);
+				free(event);
+				dropped = 1;
+			}
+		}
+		event = next;
+	}
 
-			free(task->source);
-			free(task->target);
-			free(task->filename);
-			free(task->operation);
-			free(task);
+	for (TaskSource *queue = task_sources; queue; queue = queue->next) {
+		if (strcmp(queue->source, info->source))
+			continue;
+		for (int task_class = 0; task_class < TASK_CLASSES; task_class++) {
+			WorkerQueueItem *task = queue->heads[task_class];
+			while (task) {
+				WorkerQueueItem *next = task->next;
+				if (!task->from && strcmp(task->operation, "DELETED") && *task_path(task) && path_within(task->filename, path)) {
+					remove_task(task);
+					dropped = 1;
+				}
+				task = next;
+			}
 		}
 	}
+	return dropped;
 }
 
-void setup_inotify() {
-	inotify_fd = inotify_init();
-	if (inotify_fd == -1) {
-		perror("inotify_init");
-		exit(EXIT_FAILURE);
+void handle_file_event(SyncInfo *info, const char *filename, uint32_t mask, uint32_t cookie, long long now);
+
+// Function to handle a file or directory that left the watched tree of a pair
+void handle_moved_out(SyncInfo *info, const char *filename, int is_dir, long long now) {
+	if (is_dir) {
+		// Nothing below it is there to copy any more, and its watches would report it from elsewhere
+		settle_moved_changes(info, filename);
+		remove_watches_below(info, filename);
 	}
+	handle_file_event(info, filename, IN_DELETE | (is_dir ? IN_ISDIR : 0), 0, now);
 }
 
-SyncInfo *find_sync_info_by_wd(int wd) {
-	SyncInfo *curr = sync_info_mem_store;
-	while (curr) {
-		if (curr->wd == wd) {
-			return curr;
+// Function to handle a file or directory that came into the watched tree of a pair, complete
+void handle_moved_in(SyncInfo *info, const char *filename, int is_dir, long long now) {
+	handle_file_event(info, filename, IN_CREATE | IN_CLOSE_WRITE | (is_dir ? IN_ISDIR : 0), 0, now);
+}
+
+// Function to handle a rename inside the tree of a pair: the target is renamed too, instead of copied again
+void handle_rename(SyncInfo *info, const char *from, const char *filename, int is_dir, long long now) {
+	// What waits for the new path, e.g. the deletion of the file it replaces, goes first
+	PendingEvent *pending = find_pending_event(info, filename, hash_string(filename, (size_t)info));
+	if (pending)
+		flush_pending_event(pending);
+
+	int dropped = settle_moved_changes(info, from);
+	queue_rename(info, from, filename);
+	if (is_dir)
+		rename_watches(info, from, filename);
+
+	// Changes the target did not get yet are copied from the new path after the rename
+	if (dropped)
+		start_worker_with_operation(info->source, info->target, filename, is_dir ? "FULL" : "MODIFIED", TASK_BULK);
+}
+
+// Function to handle the moves whose IN_MOVED_TO did not come in time: they left the watched trees
+void flush_expired_moves(long long now) {
+	while (pending_moves && now - pending_moves->ms >= MOVE_WINDOW_MS) {
+		PendingMove *move = pending_moves;
+		pending_moves = move->next;
+		handle_moved_out(move->info, move->filename, move->is_dir, now);
+		free(move->filename);
+		free(move);
+	}
+}
+
+// Function to handle a change of the file filename of a sync pair, with the IN_* bits of the event. The two
+// halves of a move share a cookie, 0 if they cannot be paired
+void handle_file_event(SyncInfo *info, const char *filename, uint32_t mask, uint32_t cookie, long long now) {
+	int is_dir = (mask & IN_ISDIR) != 0;
+	if (mask & IN_MOVED_FROM) {
+		if (!cookie) {
+			handle_moved_out(info, filename, is_dir, now);
+			return;
+		}
+		// Wait for the other half of the move
+		PendingMove *move = malloc(sizeof(*move));
+		move->cookie = cookie;
+		move->info = info;
+		move->filename = strdup(filename);
+		move->is_dir = is_dir;
+		move->ms = now;
+		move->next = NULL;
+		PendingMove **link = &pending_moves;
+		while (*link)
+			link = &(*link)->next;
+		*link = move;
+		return;
+	}
+	if (mask & IN_MOVED_TO) {
+		PendingMove **link = &pending_moves;
+		while (*link && (!cookie || (*link)->cookie != cookie))
+			link = &(*link)->next;
+		PendingMove *move = *link;
+		if (!move) {
+			handle_moved_in(info, filename, is_dir, now);
+			return;
+		}
+		*link = move->next;
+		if (move->info == info) {
+			handle_rename(info, move->filename, filename, is_dir, now);
+		}
+		else {
+			// Moved from the tree of one pair to another's
+			handle_moved_out(move->info, move->filename, is_dir, now);
+			handle_moved_in(info, filename, is_dir, now);
+		}
+		free(move->filename);
+		free(move);
+		return;
+	}
+
+	if ((mask & IN_ISDIR) && (mask & IN_CREATE)) {
+		// A pending deletion of an older directory with this name has to go first
+		PendingEvent *pending = find_pending_event(info, filename, hash_string(filename, (size_t)info));
+		if (pending)
+			flush_pending_event(pending);
+
+		// Watch the new subtree and copy whatever was created in it before the watches were in place
+		add_watch_recursive(info, filename);
+		start_worker_with_operation(info->source, info->target, filename, "FULL", TASK_BULK);
+	}
+	else {
+		const char *operation = NULL;
+		// Check for the operation occured
+		if (mask & IN_CREATE)
+			operation = "ADDED";
+		else if ((mask & (IN_MODIFY | IN_CLOSE_WRITE)) && !(mask & IN_ISDIR))
+			operation = "MODIFIED";
+		else if (mask & IN_DELETE)
+			operation = "DELETED";
+
+		if (operation != NULL) {
+			coalesce_event(info, filename, operation, mask & IN_CLOSE_WRITE, now);
 		}
-		curr = curr->next;
 	}
-	return NULL;
 }
 
-// Function to handle the filesystem events that the program receives from inotify
-void handle_inotify_events() {   
-	char buffer[4096];
-    ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
-
-    if (len <= 0) return;
-
-    for (char *ptr = buffer ; ptr < buffer + len ; ) {
-        struct inotify_event *event = (struct inotify_event *)ptr;
-		SyncInfo *info = find_sync_info_by_wd(event->wd);
-
-        if (info != NULL && event->len > 0) {
-            char *filename = event->name;
-            const char *operation = NULL;
-			// Check for the operation occured
-            if (event->mask & IN_CREATE)
-                operation = "ADDED";
-            else if (event->mask & IN_MODIFY)
-                operation = "MODIFIED";
-            else if (event->mask & IN_DELETE)
-                operation = "DELETED";
-
-            if (operation != NULL) {
-                start_worker_with_operation( info->source, info->target, filename, operation);
-            }
+// Function to process the events of a buffer read from inotify
+void process_inotify_events(const char *buffer, ssize_t len) {
+	long long now = now_ms();
+    for (const char *ptr = buffer ; ptr < buffer + len ; ) {
+        const struct inotify_event *event = (const struct inotify_event *)ptr;
+		WatchEntry *watch = find_watch(event->wd);
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			// The kernel dropped events, the pairs have to be compared with their targets
+			schedule_rescans(inotify_drained_at);
+		}
+		else if (watch != NULL && (event->mask & IN_IGNORED)) {
+			// The directory is gone or no longer watched
+			remove_watch_entry(event->wd);
+		}
+        else if (watch != NULL && event->len > 0) {
+			// Events name a file of the watched directory, workers expect a path relative to the source
+			char filename[PATH_MAX];
+			if (*watch->path)
+				snprintf(filename, sizeof(filename), "%s/%s", watch->path, event->name);
+			else
+				snprintf(filename, sizeof(filename), "%s", event->name);
+
+			handle_file_event(watch->info, filename, event->mask, event->cookie, now);
         }
 		ptr += sizeof(struct inotify_event) + event->len; // move on to the next event in the buffer
     }
 }
 
-// Function to log given message in the given logfile
-void log_message(const char *logfile, const char *message) {
-	FILE *fp = fopen(logfile, "a");
-	if (!fp)
+// Function to handle the filesystem events that the program receives from inotify, reading them in large
+// batches until the queue is empty
+void handle_inotify_events() {   
+	static char buffer[INOTIFY_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	for (int reads = 0; reads < INOTIFY_MAX_READS; reads++) {
+		// Taken before the read: once it finds the queue empty, every change made before then has been seen
+		time_t read_at = time(NULL);
+		ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+		if (len <= 0) {
+			if (len == -1 && errno == EAGAIN)
+				inotify_drained_at = read_at;
+			return;
+		}
+		process_inotify_events(buffer, len);
+	}
+}
+
+// Function to handle an event of a fanotify mark. A mark sees the whole filesystem, so the event goes to the
+// pairs whose source holds the file
+void handle_fanotify_event(const char *dir, const char *name, uint32_t mask, void *arg) {
+	if (mask & IN_Q_OVERFLOW) {
+		schedule_rescans(fanotify_drained_at);
 		return;
+	}
 
-	time_t now = time(NULL);
-	struct tm *t = localtime(&now);
-	fprintf(fp, "[%04d-%02d-%02d %02d:%02d:%02d] %s\n",
-			t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-			t->tm_hour, t->tm_min, t->tm_sec, message);
-	fclose(fp);
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))
+		return;
+	for (SyncInfo *curr = sync_info_mem_store; curr; curr = curr->next) {
+		if (!curr->source_path)
+			continue;
+		size_t len = strlen(curr->source_path);
+		if (!strncmp(path, curr->source_path, len) && path[len] == '/')
+			handle_file_event(curr, path + len + 1, mask, 0, *(long long *)arg);
+	}
 }
 
-// Function to log result in the format requested in the assignment
-void log_sync_result(const char *logfile, const char *source, const char *target, pid_t worker_pid,
-					const char *operation, const char *result, const char *details) {
-	FILE *fp = fopen(logfile, "a");
-	if (!fp)
-		return;
+// Function to handle the filesystem events of the fanotify marks, reading them until the queue is empty
+void handle_fanotify_events() {
+	static char buffer[FANOTIFY_BUFFER_SIZE] __attribute__((aligned(__alignof__(uint64_t))));
+	for (int reads = 0; reads < INOTIFY_MAX_READS; reads++) {
+		time_t read_at = time(NULL);
+		ssize_t len = read(fanotify_fd, buffer, sizeof(buffer));
+		if (len <= 0) {
+			if (len == -1 && errno == EAGAIN)
+				fanotify_drained_at = read_at;
+			return;
+		}
+		long long now = now_ms();
+		fanotify_monitor_process(buffer, len, handle_fanotify_event, &now);
+	}
+}
 
-	time_t now = time(NULL);
-	struct tm *t = localtime(&now);
+// Function to log given message in the manager log
+void log_message(const char *message) {
+	log_printf("%s", message);
+}
 
-	fprintf(fp, "[%04d-%02d-%02d %02d:%02d:%02d] [%s] [%s] [%d] [%s] [%s] [%s]\n",
-			t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-			t->tm_hour, t->tm_min, t->tm_sec,
-			source, target, worker_pid, operation, result, details);
+// Function to log result in the format requested in the assignment
+void log_sync_result(const char *source, const char *target, pid_t worker_pid,
+					const char *operation, const char *result, const char *details) {
+	log_printf("[%s] [%s] [%d] [%s] [%s] [%s]", source, target, worker_pid, operation, result, details);
 
-	fclose(fp);
+	EventRecord record = {
+		.type = EVENT_SYNC, .pid = worker_pid, .timestamp = time(NULL),
+		.source = source, .target = target, .operation = operation, .result = result
+	};
+	event_log_append(&record);
 }
 
 // Function to display EXEC_REPORT as it is requested in the assignment
@@ -351,11 +2025,150 @@ void display_exec_report(const char *source, const char *target, const char *ope
 	fflush(stdout);
 }
 
+// Function to write the counters of the manager and of every sync pair for the stats command
+void write_stats(FILE *stream) {
+	size_t moves = 0;
+	for (PendingMove *curr = pending_moves; curr; curr = curr->next)
+		moves++;
+	char summary[128];
+
+	fprintf(stream, "Queue: %zu queued operations, %zu pending events, %zu pending moves\n", queued_tasks, pending_count, moves);
+	histogram_summary(summary, sizeof(summary), &spawn_histogram);
+	fprintf(stream, "Workers: %u/%d active, %d/%d running, %llu spawned, %llu exited unexpectedly, fork %s\n",
+			active_workers, worker_limit, running_workers(), worker_limit, workers_spawned, worker_crashes, summary);
+	fprintf(stream, "Operations: %llu done, %llu failed (%.1f%%), %llu files and %lld bytes copied\n",
+			operations_done, operation_errors, operations_done ? 100.0 * operation_errors / operations_done : 0.0,
+			files_copied, bytes_copied);
+	histogram_summary(summary, sizeof(summary), &operation_histogram);
+	fprintf(stream, "Operation time: %s\n", summary);
+	histogram_summary(summary, sizeof(summary), &batch_histogram);
+	fprintf(stream, "Batch time: %s\n", summary);
+	histogram_summary(summary, sizeof(summary), &latency_histogram);
+	fprintf(stream, "Replication latency: %s\n", summary);
+
+	for (SyncInfo *curr = sync_info_mem_store; curr; curr = curr->next) {
+		size_t queued = 0;
+		for (TaskSource *queue = task_sources; queue; queue = queue->next) {
+			if (!strcmp(queue->source, curr->source))
+				queued = queue->queued;
+		}
+		histogram_summary(summary, sizeof(summary), &curr->latency);
+		fprintf(stream, "Pair: %s -> %s (%s)\n", curr->source, curr->target, curr->active ? "Active" : "Inactive");
+		fprintf(stream, "  Operations: %llu done, %llu failed, %zu queued, %llu files and %lld bytes copied\n",
+				curr->operations, curr->failed_operations, queued, curr->files_copied, curr->bytes_copied);
+		fprintf(stream, "  Replication latency: %s\n", summary);
+	}
+}
+
+// Function to write one sample of a metric per sync pair, labelled with its directories
+void write_pair_metric(FILE *stream, const char *name, const char *type, const char *help,
+					   unsigned long long (*value)(const SyncInfo *info)) {
+	fprintf(stream, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	for (SyncInfo *curr = sync_info_mem_store; curr; curr = curr->next) {
+		fprintf(stream, "%s{source=\"", name);
+		write_label_value(stream, curr->source);
+		fprintf(stream, "\",target=\"");
+		write_label_value(stream, curr->target);
+		fprintf(stream, "\"} %llu\n", value(curr));
+	}
+}
+
+static unsigned long long pair_operations(const SyncInfo *info) { return info->operations; }
+static unsigned long long pair_failed_operations(const SyncInfo *info) { return info->failed_operations; }
+static unsigned long long pair_files_copied(const SyncInfo *info) { return info->files_copied; }
+static unsigned long long pair_bytes_copied(const SyncInfo *info) { return info->bytes_copied; }
+static unsigned long long pair_active(const SyncInfo *info) { return info->active; }
+
+static unsigned long long pair_queued(const SyncInfo *info) {
+	for (TaskSource *queue = task_sources; queue; queue = queue->next) {
+		if (!strcmp(queue->source, info->source))
+			return queue->queued;
+	}
+	return 0;
+}
+
+// Function to write the counters to metrics_file in the Prometheus text format, replacing it at once so that a
+// collector never reads half of it
+void write_metrics_file() {
+	metrics_written_ms = now_ms();
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics_file) >= (int)sizeof(tmp_path))
+		return;
+	FILE *stream = fopen(tmp_path, "w");
+	if (!stream) {
+		perror("open metrics file");
+		return;
+	}
+
+	fprintf(stream, "# HELP fss_queued_operations Operations waiting for a worker\n# TYPE fss_queued_operations gauge\n"
+			"fss_queued_operations %zu\n", queued_tasks);
+	fprintf(stream, "# HELP fss_pending_events Changes waiting for their quiet window\n# TYPE fss_pending_events gauge\n"
+			"fss_pending_events %zu\n", pending_count);
+	fprintf(stream, "# HELP fss_active_workers Workers running a batch\n# TYPE fss_active_workers gauge\n"
+			"fss_active_workers %u\n", active_workers);
+	fprintf(stream, "# HELP fss_worker_limit Size of the worker pool\n# TYPE fss_worker_limit gauge\n"
+			"fss_worker_limit %d\n", worker_limit);
+	fprintf(stream, "# HELP fss_running_workers Slots of the pool with a running worker\n# TYPE fss_running_workers gauge\n"
+			"fss_running_workers %d\n", running_workers());
+	fprintf(stream, "# HELP fss_workers_spawned_total Worker processes started\n# TYPE fss_workers_spawned_total counter\n"
+			"fss_workers_spawned_total %llu\n", workers_spawned);
+	fprintf(stream, "# HELP fss_worker_crashes_total Workers that exited unexpectedly\n# TYPE fss_worker_crashes_total counter\n"
+			"fss_worker_crashes_total %llu\n", worker_crashes);
+
+	fprintf(stream, "# HELP fss_worker_spawn_seconds Time to fork a worker\n# TYPE fss_worker_spawn_seconds histogram\n");
+	histogram_write_prometheus(stream, "fss_worker_spawn_seconds", "", &spawn_histogram);
+	fprintf(stream, "# HELP fss_operation_duration_seconds Time a worker took for an operation\n"
+			"# TYPE fss_operation_duration_seconds histogram\n");
+	histogram_write_prometheus(stream, "fss_operation_duration_seconds", "", &operation_histogram);
+	fprintf(stream, "# HELP fss_batch_duration_seconds Time from handing a batch to a worker to its last report\n"
+			"# TYPE fss_batch_duration_seconds histogram\n");
+	histogram_write_prometheus(stream, "fss_batch_duration_seconds", "", &batch_histogram);
+
+	write_pair_metric(stream, "fss_pair_active", "gauge", "Whether the sync pair is monitored", pair_active);
+	write_pair_metric(stream, "fss_pair_queued_operations", "gauge", "Operations of the sync pair waiting for a worker", pair_queued);
+	write_pair_metric(stream, "fss_pair_operations_total", "counter", "Operations reported for the sync pair", pair_operations);
+	write_pair_metric(stream, "fss_pair_operation_errors_total", "counter", "Operations of the sync pair that failed", pair_failed_operations);
+	write_pair_metric(stream, "fss_pair_files_copied_total", "counter", "Files copied to the target", pair_files_copied);
+	write_pair_metric(stream, "fss_pair_bytes_copied_total", "counter", "Bytes written to the target", pair_bytes_copied);
+
+	fprintf(stream, "# HELP fss_pair_replication_latency_seconds Time from the first event of a change to the report of its operation\n"
+			"# TYPE fss_pair_replication_latency_seconds histogram\n");
+	for (SyncInfo *curr = sync_info_mem_store; curr; curr = curr->next) {
+		char *labels;
+		size_t labels_len;
+		FILE *label_stream = open_memstream(&labels, &labels_len);
+		if (!label_stream)
+			break;
+		fprintf(label_stream, "source=\"");
+		write_label_value(label_stream, curr->source);
+		fprintf(label_stream, "\",target=\"");
+		write_label_value(label_stream, curr->target);
+		fprintf(label_stream, "\"");
+		fclose(label_stream);
+		histogram_write_prometheus(stream, "fss_pair_replication_latency_seconds", labels, &curr->latency);
+		free(labels);
+	}
+
+	if (fclose(stream) != 0 || rename(tmp_path, metrics_file) == -1) {
+		perror("write metrics file");
+		unlink(tmp_path);
+	}
+}
+
+// Milliseconds until the metrics file is due, -1 when it is not written
+int metrics_timeout_ms(long long now) {
+	if (!metrics_file)
+		return -1;
+	long long remaining = metrics_written_ms + METRICS_INTERVAL_MS - now;
+	return remaining > 0 ? (int)remaining : 0;
+}
+
 // Function to free a sync info node
 void free_sync_info(SyncInfo *node) {
     if (node) {
         free(node->source);
         free(node->target);
+        free(node->source_path);
         if (node->last_operation) {
             free(node->last_operation);
         }
@@ -374,7 +2187,7 @@ void free_sync_info_list(SyncInfo *head) {
 }
 
 // Function to process a command given from the fss_console
-void process_command(const char *command, const char *logfile, int fss_in_fd, int fss_out_fd) {
+void process_command(const char *command, int fss_in_fd, int fss_out_fd) {
 	char cmd[32], source[128], target[128];
 	time_t now = time(NULL);
 	struct tm *t = localtime(&now);
@@ -421,19 +2234,39 @@ void process_command(const char *command, const char *logfile, int fss_in_fd, in
 		new_node->last_sync = time(NULL);
 		new_node->last_worker_pid = -1;
 		new_node->error_count = 0;
-		new_node->worker_pipe_fd = -1;
 		new_node->last_operation = NULL;
+		new_node->weight = 1;
+		new_node->max_workers = 0;
+		new_node->cache_policy = CACHE_KEEP;
+		new_node->direct_min = DIRECT_MIN_SIZE;
+		new_node->synced_at = 0;
+		new_node->reconcile = RECONCILE_DONE;
+		new_node->reconcile_errors = 0;
+		new_node->source_path = NULL;
+		new_node->operations = new_node->failed_operations = new_node->files_copied = 0;
+		new_node->bytes_copied = 0;
+		memset(&new_node->latency, 0, sizeof(new_node->latency));
 		new_node->next = sync_info_mem_store;
 		sync_info_mem_store = new_node;
 
+		// The same key=value settings as in the config file may follow the directories
+		char options[256];
+		int options_start = 0;
+		sscanf(command, "%*s %*s %*s %n", &options_start);
+		snprintf(options, sizeof(options), "%s", options_start ? command + options_start : "");
+		for (char *option = strtok(options, " "); option; option = strtok(NULL, " ")) {
+			if (apply_pair_option(new_node, option) == -1)
+				fprintf(stderr, "Unknown option for %s: %s\n", source, option);
+		}
+
 		snprintf(log_msg, sizeof(log_msg), "Added directory: %s -> %s", source, target);
-		log_message(logfile, log_msg);
+		log_message(log_msg);
 
-		new_node->wd = inotify_add_watch(inotify_fd, new_node->source, IN_CREATE | IN_MODIFY | IN_DELETE);
+		new_node->wd = add_watch_recursive(new_node, "");
 		if (new_node->wd == -1) {
 			// No watch descriptor -- something came up and source cannot be monitored
 			snprintf(log_msg, sizeof(log_msg), "Failed to monitor %s", new_node->source);
-			log_message(logfile, log_msg);
+			log_message(log_msg);
 
 			snprintf(response, sizeof(response), "[%s] Failed to monitor %s\n", timestamp, new_node->source);
 			ssize_t written = write(fss_out_fd, response, strlen(response));
@@ -443,7 +2276,7 @@ void process_command(const char *command, const char *logfile, int fss_in_fd, in
 		}
 		else {
 			snprintf(log_msg, sizeof(log_msg), "Monitoring started for %s", new_node->source);
-			log_message(logfile, log_msg);
+			log_message(log_msg);
 			snprintf(response, sizeof(response), "[%s] Added directory: %s -> %s\n[%s] Monitoring started for %s\n",
 					 timestamp, source, target, timestamp, new_node->source);
 			ssize_t written = write(fss_out_fd, response, strlen(response));
@@ -453,13 +2286,13 @@ void process_command(const char *command, const char *logfile, int fss_in_fd, in
 			fsync(fss_out_fd);
 
 			// Execute worker to sync fully the source
-			start_worker_with_operation(source, target, "ALL", "FULL");
+			start_worker_with_operation(source, target, "ALL", "FULL", TASK_BACKGROUND);
 		}
 	}
 
 	else if (strcmp(cmd, "status") == 0) {
 		snprintf(log_msg, sizeof(log_msg), "Status requested for %s", source);
-		log_message(logfile, log_msg);
+		log_message(log_msg);
 
 		SyncInfo *curr = sync_info_mem_store;
 		int found = 0;
@@ -513,10 +2346,12 @@ void process_command(const char *command, const char *logfile, int fss_in_fd, in
 				if (curr->active) {
 					// Source directory exists and it is active so we stop watching it
 					curr->active = 0;
-					inotify_rm_watch(inotify_fd, curr->wd);
+					remove_watches(curr);
 
 					snprintf(log_msg, sizeof(log_msg), "Monitoring stopped for %s", source);
-					log_message(logfile, log_msg);
+					log_message(log_msg);
+					EventRecord record = { .type = EVENT_STOPPED, .timestamp = time(NULL), .source = source };
+					event_log_append(&record);
 
 					snprintf(response, sizeof(response), "[%s] Monitoring stopped for %s\n", timestamp, source);
 				}
@@ -565,15 +2400,14 @@ void process_command(const char *command, const char *logfile, int fss_in_fd, in
 				}
 
 				snprintf(log_msg, sizeof(log_msg), "Syncing directory: %s -> %s", source, curr->target);
-				log_message(logfile, log_msg);
+				log_message(log_msg);
 
 				int written = snprintf(response, sizeof(response), "[%s] Syncing directory: %s -> %s\n", timestamp, source, curr->target);
 
 				// Add to inotify watch
-				curr->wd = inotify_add_watch(inotify_fd, curr->source,
-					IN_CREATE | IN_MODIFY | IN_DELETE);
+				curr->wd = add_watch_recursive(curr, "");
 
-				start_worker_with_operation(source, curr->target, "ALL", "FULL");
+				start_worker_with_operation(source, curr->target, "ALL", "FULL", TASK_INTERACTIVE);
 
 				curr->active = 1;
 
@@ -600,9 +2434,29 @@ void process_command(const char *command, const char *logfile, int fss_in_fd, in
 		}
 	}
 
+	else if (strcmp(cmd, "stats") == 0) {
+		log_message("Stats requested");
+
+		// One line per sync pair, more than a fixed buffer holds
+		char *stats;
+		size_t stats_len;
+		FILE *stream = open_memstream(&stats, &stats_len);
+		if (!stream) {
+			perror("open_memstream");
+			return;
+		}
+		fprintf(stream, "[%s] Stats requested\n", timestamp);
+		write_stats(stream);
+		fclose(stream);
+		if (write_all(fss_out_fd, stats, stats_len) == -1) {
+			perror("write to fss_out_fd failed");
+		}
+		free(stats);
+	}
+
 	else if (strcmp(cmd, "shutdown") == 0) {
 		snprintf(log_msg, sizeof(log_msg), "Shutting down manager");
-		log_message(logfile, log_msg);
+		log_message(log_msg);
 
 		snprintf(response, sizeof(response),
 				 "[%s] Shutting down manager...\n"
@@ -617,24 +2471,29 @@ void process_command(const char *command, const char *logfile, int fss_in_fd, in
 		}
 		fsync(fss_out_fd);
 
-		while (active_workers > 0) {
-			sleep(1);
-		}
+		// Every change made before now is either in the inotify queue or seen already, so once the queue is read
+		// and the workers are done the targets are in sync as of now
+		time_t synced_at = time(NULL);
+		int unread;
+		while (ioctl(inotify_fd, FIONREAD, &unread) == 0 && unread > 0)
+			handle_inotify_events();
+		while (fanotify_fd != -1 && ioctl(fanotify_fd, FIONREAD, &unread) == 0 && unread > 0)
+			handle_fanotify_events();
 
-		// Process remained tasks in the queue
-		while (task_queue) {
-			WorkerQueueItem *task = task_queue;
-			start_worker_with_operation(task->source, task->target,
-										task->filename, task->operation);
-			task_queue = task_queue->next;
-			free(task->source);
-			free(task->target);
-			free(task->filename);
-			free(task->operation);
-			free(task);
-		}
+		// Let the workers finish the pending events, the active jobs and the remaining tasks in the queue
+		flush_expired_moves(now_ms() + MOVE_WINDOW_MS);
+		flush_all_pending_events();
+		wait_for_workers();
+		stop_worker_pool();
+		save_state(state_file, synced_at);
 
+		if (metrics_file)
+			write_metrics_file();
+
+		free_watches();
 		free_sync_info_list(sync_info_mem_store);
+		log_close();
+		event_log_close();
 
 		exit(EXIT_SUCCESS);
 	}
@@ -649,6 +2508,32 @@ void process_command(const char *command, const char *logfile, int fss_in_fd, in
 }
 
 
+// Function to read a command from the console and process it; the pipe is reopened when the console goes away
+void handle_console_input(int *fss_in_fd, int fss_out_fd) {
+	char command[256];
+	ssize_t bytes = read(*fss_in_fd, command, sizeof(command) - 1);
+	if (bytes > 0) {
+		command[bytes] = '\0';
+		if (command[strlen(command) - 1] == '\n') {
+			command[strlen(command) - 1] = '\0';
+		}
+		process_command(command, *fss_in_fd, fss_out_fd);
+	}
+	else if (bytes == 0) {
+		// Closing the pipe also removes it from the epoll set
+		close(*fss_in_fd);
+		*fss_in_fd = open("fss_in", O_RDONLY);
+		if (*fss_in_fd == -1) {
+			perror("Failed to reopen fss_in");
+			return;
+		}
+		watch_fd(*fss_in_fd);
+	}
+	else {
+		perror("read from fss_in");
+	}
+}
+
 int main(int argc, char *argv[]) {
 	logfile = "manager.log";
 	char *config_file = NULL;
@@ -657,7 +2542,7 @@ int main(int argc, char *argv[]) {
 
 	int i = 1;
 	if (argc < 5) {
-		fprintf(stderr, "Usage: %s -l <logfile> -c <sync_info_mem_store> [-n <workers>]\n", argv[0]);
+		fprintf(stderr, "Usage: %s -l <logfile> -c <sync_info_mem_store> [-n <workers>] [-d <debounce_ms>] [-t <copy_threads>] [-H] [-D <delta_min_bytes>] [-s <slice_files>] [-p <state_file>] [-r <reconcile_pairs>] [-F] [-L <max_log_bytes>] [-m <metrics_file>]\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 	while (i < argc) {
@@ -687,9 +2572,97 @@ int main(int argc, char *argv[]) {
 				i += 2;
 			}
 		}
+		else if (strcmp(argv[i], "-t") == 0) {
+			if (i + 1 < argc) {
+				copy_threads = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else {
+				fprintf(stderr, "Missing thread count for -t option\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(argv[i], "-D") == 0) {
+			if (i + 1 < argc) {
+				delta_min_size = argv[i + 1];
+				i += 2;
+			}
+			else {
+				fprintf(stderr, "Missing size for -D option\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(argv[i], "-s") == 0) {
+			if (i + 1 < argc) {
+				slice_files = argv[i + 1];
+				i += 2;
+			}
+			else {
+				fprintf(stderr, "Missing file count for -s option\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(argv[i], "-p") == 0) {
+			if (i + 1 < argc) {
+				state_file = argv[i + 1];
+				i += 2;
+			}
+			else {
+				fprintf(stderr, "Missing filename for -p option\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(argv[i], "-r") == 0) {
+			if (i + 1 < argc) {
+				reconcile_limit = atoi(argv[i + 1]) > 0 ? atoi(argv[i + 1]) : 1;
+				i += 2;
+			}
+			else {
+				fprintf(stderr, "Missing pair count for -r option\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(argv[i], "-m") == 0) {
+			if (i + 1 < argc) {
+				metrics_file = argv[i + 1];
+				i += 2;
+			}
+			else {
+				fprintf(stderr, "Missing filename for -m option\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(argv[i], "-L") == 0) {
+			if (i + 1 < argc) {
+				log_max_bytes = atoll(argv[i + 1]);
+				i += 2;
+			}
+			else {
+				fprintf(stderr, "Missing size for -L option\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(argv[i], "-F") == 0) {
+			use_fanotify = 1;
+			i++;
+		}
+		else if (strcmp(argv[i], "-H") == 0) {
+			hash_contents = 1;
+			i++;
+		}
+		else if (strcmp(argv[i], "-d") == 0) {
+			if (i + 1 < argc) {
+				debounce_ms = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else {
+				fprintf(stderr, "Missing milliseconds for -d option\n");
+				exit(EXIT_FAILURE);
+			}
+		}
 		else {
 			fprintf(stderr, "Unknown option: %s\n", argv[i]);
-			fprintf(stderr, "Usage: %s -l <logfile> -c <sync_info_mem_store> [-n <workers>]\n", argv[0]);
+			fprintf(stderr, "Usage: %s -l <logfile> -c <sync_info_mem_store> [-n <workers>] [-d <debounce_ms>] [-t <copy_threads>] [-H] [-D <delta_min_bytes>] [-s <slice_files>] [-p <state_file>] [-r <reconcile_pairs>] [-F] [-L <max_log_bytes>] [-m <metrics_file>]\n", argv[0]);
 			exit(EXIT_FAILURE);
 		}
 	}
@@ -697,29 +2670,45 @@ int main(int argc, char *argv[]) {
 	create_named_pipes();
 
 	setup_inotify();
-	
-	signal(SIGCHLD, sigchld_handler);
+	setup_event_loop();
+	watch_fd(inotify_fd);
+	setup_fanotify();
+	signal(SIGPIPE, SIG_IGN); // a dead worker is noticed by the failed write instead
 
-	clean_logs(logfile);
+	start_worker_pool();
+
+	if (log_open(logfile, log_max_bytes) == -1)
+		perror("open log file");
+	if (event_log_open(logfile) == -1)
+		perror("open event log");
 	parse_config(config_file);
+	if (!state_file) {
+		static char default_state_file[PATH_MAX];
+		snprintf(default_state_file, sizeof(default_state_file), "%s.state", config_file);
+		state_file = default_state_file;
+	}
+	load_state(state_file);
 	SyncInfo *curr = sync_info_mem_store;
 	while (curr) {
 		char log_buffer[1000];
 
-		curr->wd = inotify_add_watch(inotify_fd, curr->source, IN_CREATE | IN_MODIFY | IN_DELETE);
+		curr->wd = add_watch_recursive(curr, "");
 		if (curr->wd == -1) {
 			printf("Failed to monitor %s\n", curr->source);
 			snprintf(log_buffer, sizeof(log_buffer), "Failed to monitor %s", curr->source);
-			log_message(logfile, log_buffer);
+			log_message(log_buffer);
 		}
 		else {
 			snprintf(log_buffer, sizeof(log_buffer), "Added directory: %s -> %s", curr->source, curr->target);
-			log_message(logfile, log_buffer);
+			log_message(log_buffer);
 			printf("Monitoring started for %s\n", curr->source);
 			snprintf(log_buffer, sizeof(log_buffer), "Monitoring started for %s", curr->source);
-			log_message(logfile, log_buffer);
+			log_message(log_buffer);
 
-			start_worker_with_operation( curr->source, curr->target, "ALL", "FULL");
+			// Synchronized when its turn comes, see start_reconciliations()
+			curr->reconcile = RECONCILE_WAITING;
+			curr->reconcile_errors = curr->error_count;
+			reconciling_pairs++;
 		}
 		curr = curr->next;
 	}
@@ -732,60 +2721,58 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
-	fd_set read_fds;
-	while (1) {
-
-		FD_ZERO(&read_fds);
-		int max_fd = -1;
+	watch_fd(fss_in_fd);
 
-		if (inotify_fd != -1) {
-			FD_SET(inotify_fd, &read_fds);
-			if (inotify_fd > max_fd) max_fd = inotify_fd;
+	struct epoll_event events[64];
+	while (1) {
+		// Hand what was queued since the last round to the workers, batched per source
+		start_reconciliations();
+		dispatch_queued_tasks();
+
+		// Write what the last round logged at once, before waiting for more
+		log_flush();
+		event_log_flush();
+		if (metrics_file && metrics_timeout_ms(now_ms()) == 0)
+			write_metrics_file();
+
+		// Wake up in time for the oldest pending event, for the next metrics file and for a worker to restart
+		long long now = now_ms();
+		int timeout = pending_timeout_ms(now);
+		int metrics_timeout = metrics_timeout_ms(now);
+		if (metrics_timeout != -1 && (timeout == -1 || metrics_timeout < timeout))
+			timeout = metrics_timeout;
+		int respawn_timeout = respawn_timeout_ms(now);
+		if (respawn_timeout != -1 && (timeout == -1 || respawn_timeout < timeout))
+			timeout = respawn_timeout;
+		int count = epoll_wait(epoll_fd, events, 64, timeout);
+		if (count == -1) {
+			if (errno != EINTR)
+				perror("epoll_wait");
+			continue;
 		}
 
-		if (fss_in_fd != -1) {
-			FD_SET(fss_in_fd, &read_fds);
-			if (fss_in_fd > max_fd) max_fd = fss_in_fd;
-		}
+		// Dispatch the events whose quiet window has passed, and the moves out of the watched trees
+		flush_expired_events(now_ms());
+		flush_expired_moves(now_ms());
 
-		if (max_fd == -1) {
-			sleep(1);
-			continue;
-		}
+		for (int i = 0; i < count; i++) {
+			int fd = events[i].data.fd;
 
-		int sel_ret = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
-		if (sel_ret == -1) {
-			if (errno == EINTR) continue;
-			perror("select");
-			continue;
-		}
+			// Handle filesystem events
+			if (fd == inotify_fd)
+				handle_inotify_events();
+			else if (fd == fanotify_fd)
+				handle_fanotify_events();
 
-		// Handle filesystem events
-		if (inotify_fd != -1 && FD_ISSET(inotify_fd, &read_fds)) {
-			handle_inotify_events();
-		}
+			// Handle reports from workers, and their exits
+			else if (fd == worker_epoll_fd)
+				handle_worker_events(0);
+			else if (fd == signal_fd)
+				reap_workers();
 
-		// Handle commands from console
-		if (fss_in_fd != -1 && FD_ISSET(fss_in_fd, &read_fds)) {
-			char command[256];
-			ssize_t bytes = read(fss_in_fd, command, sizeof(command) - 1);
-			if (bytes > 0) {
-				command[bytes] = '\0';
-				if (command[strlen(command) - 1] == '\n') {
-					command[strlen(command) - 1] = '\0';
-				}
-				process_command(command, logfile, fss_in_fd, fss_out_fd);
-			}
-			else if (bytes == 0) {
-				close(fss_in_fd);
-				fss_in_fd = open("fss_in", O_RDONLY);
-				if (fss_in_fd == -1) {
-					perror("Failed to reopen fss_in");
-				}
-			}
-			else {
-				perror("read from fss_in");
-			}
+			// Handle commands from console
+			else if (fd == fss_in_fd)
+				handle_console_input(&fss_in_fd, fss_out_fd);
 		}
 	}
-}
\ No newline at end of file
+}
@@ -0,0 +1,79 @@
+/* File: fss_metrics.c */
+#include <stdio.h>
+#include "fss_metrics.h"
+
+void histogram_add(Histogram *histogram, long long us) {
+	if (us < 0)
+		us = 0;
+	int bucket = 0;
+	while (bucket < HISTOGRAM_BUCKETS - 1 && us > 1LL << (bucket + HISTOGRAM_FIRST_SHIFT))
+		bucket++;
+	histogram->counts[bucket]++;
+	histogram->count++;
+	histogram->sum_us += us;
+}
+
+long long histogram_percentile(const Histogram *histogram, double fraction) {
+	if (!histogram->count)
+		return -1;
+	unsigned long long rank = (unsigned long long)(fraction * histogram->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	unsigned long long seen = 0;
+	for (int bucket = 0; bucket < HISTOGRAM_BUCKETS - 1; bucket++) {
+		seen += histogram->counts[bucket];
+		if (seen >= rank)
+			return 1LL << (bucket + HISTOGRAM_FIRST_SHIFT);
+	}
+	return -1;
+}
+
+void format_duration(char *buf, size_t size, long long us) {
+	if (us < 1000)
+		snprintf(buf, size, "%lld us", us);
+	else if (us < 10 * 1000 * 1000)
+		snprintf(buf, size, "%lld ms", us / 1000);
+	else
+		snprintf(buf, size, "%.1f s", us / 1e6);
+}
+
+void histogram_summary(char *buf, size_t size, const Histogram *histogram) {
+	if (!histogram->count) {
+		snprintf(buf, size, "no data");
+		return;
+	}
+	const double fractions[3] = { 0.5, 0.9, 0.99 };
+	const char *names[3] = { "p50", "p90", "p99" };
+	size_t len = 0;
+	for (int i = 0; i < 3 && len < size; i++) {
+		char duration[32];
+		long long bound = histogram_percentile(histogram, fractions[i]);
+		format_duration(duration, sizeof(duration), bound != -1 ? bound : 1LL << (HISTOGRAM_BUCKETS - 2 + HISTOGRAM_FIRST_SHIFT));
+		len += snprintf(buf + len, size - len, "%s%s %s %s", i ? ", " : "", names[i], bound != -1 ? "<=" : ">", duration);
+	}
+}
+
+void write_label_value(FILE *stream, const char *str) {
+	for (; *str; str++) {
+		if (*str == '\\' || *str == '"')
+			fprintf(stream, "\\%c", *str);
+		else if (*str == '\n')
+			fputs("\\n", stream);
+		else
+			fputc(*str, stream);
+	}
+}
+
+void histogram_write_prometheus(FILE *stream, const char *name, const char *labels, const Histogram *histogram) {
+	const char *separator = *labels ? "," : "";
+	unsigned long long cumulative = 0;
+	for (int bucket = 0; bucket < HISTOGRAM_BUCKETS - 1; bucket++) {
+		cumulative += histogram->counts[bucket];
+		fprintf(stream, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, separator,
+				(double)(1LL << (bucket + HISTOGRAM_FIRST_SHIFT)) / 1e6, cumulative);
+	}
+	fprintf(stream, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, separator, histogram->count);
+	const char *open = *labels ? "{" : "", *close = *labels ? "}" : "";
+	fprintf(stream, "%s_sum%s%s%s %g\n", name, open, labels, close, histogram->sum_us / 1e6);
+	fprintf(stream, "%s_count%s%s%s %llu\n", name, open, labels, close, histogram->count);
+}
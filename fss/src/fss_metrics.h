@@ -0,0 +1,40 @@
+/* File: fss_metrics.h */
+#ifndef FSS_METRICS_H
+#define FSS_METRICS_H
+
+#include <stdio.h>
+
+// Bucket i of a histogram counts the durations up to 2^(i + HISTOGRAM_FIRST_SHIFT) microseconds, from 16 us to
+// about 18 minutes; the last bucket counts the longer ones
+#define HISTOGRAM_FIRST_SHIFT 4
+#define HISTOGRAM_BUCKETS 28
+
+typedef struct histogram Histogram;
+
+// Distribution of durations, with buckets that double in width so that it takes constant space
+struct histogram {
+	unsigned long long counts[HISTOGRAM_BUCKETS];
+	unsigned long long count;
+	long long sum_us;
+};
+
+void histogram_add(Histogram *histogram, long long us);
+
+// Upper bound in microseconds of the bucket that holds the given fraction of the durations, -1 if it is empty or
+// the fraction falls in the last, unbounded, bucket
+long long histogram_percentile(const Histogram *histogram, double fraction);
+
+// Format a duration of microseconds for people, e.g. "640 us", "12 ms" or "3.5 s"
+void format_duration(char *buf, size_t size, long long us);
+
+// Describe the median, 90th and 99th percentiles of histogram, e.g. "p50 <= 262 ms, p90 <= 524 ms, p99 <= 1048 ms"
+void histogram_summary(char *buf, size_t size, const Histogram *histogram);
+
+// Write histogram in the Prometheus text format as metric name, in seconds, with labels ("" or "key=\"value\"").
+// The # TYPE line is written by the caller, once per metric
+void histogram_write_prometheus(FILE *stream, const char *name, const char *labels, const Histogram *histogram);
+
+// Write str with the backslashes, quotes and newlines escaped, as a Prometheus label value
+void write_label_value(FILE *stream, const char *str);
+
+#endif
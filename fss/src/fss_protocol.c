@@ -0,0 +1,161 @@
+/* File: fss_protocol.c */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "fss_protocol.h"
+
+// Layout of a record on the wire. Workers and the manager run on the same host, so fields keep the
+// native byte order
+struct report_header {
+	uint32_t length;            // of the whole record, header included
+	uint8_t type;
+	uint8_t status;
+	uint16_t flags;             // REPORT_FLAG_* bits
+	int32_t pid;
+	uint32_t files;
+	uint32_t skipped;
+	uint32_t errors;
+	int64_t timestamp;
+	int64_t bytes;
+	int64_t duration_us;
+	uint32_t string_lengths[4]; // source, target, operation and details, with their NUL
+};
+
+// The FULL is not over, see ReportRecord.more
+#define REPORT_FLAG_MORE 0x1
+
+static const char *report_status_names[REPORT_STATUS_COUNT] = { "SUCCESS", "PARTIAL", "ERROR" };
+
+const char *report_status_name(int status) {
+	return status >= 0 && status < REPORT_STATUS_COUNT ? report_status_names[status] : "UNKNOWN";
+}
+
+size_t report_encode(const ReportRecord *record, char *buf, size_t size) {
+	const char *strings[4] = { record->source, record->target, record->operation, record->details };
+	struct report_header header;
+	memset(&header, 0, sizeof(header));
+
+	size_t length = sizeof(header);
+	for (int i = 0; i < 4; i++) {
+		if (!strings[i])
+			strings[i] = "";
+		header.string_lengths[i] = strlen(strings[i]) + 1;
+		length += header.string_lengths[i];
+	}
+	if (length > size)
+		return length;
+
+	header.length = length;
+	header.type = record->type;
+	header.status = record->status;
+	header.flags = record->more ? REPORT_FLAG_MORE : 0;
+	header.pid = record->pid;
+	header.files = record->files;
+	header.skipped = record->skipped;
+	header.errors = record->errors;
+	header.timestamp = record->timestamp;
+	header.bytes = record->bytes;
+	header.duration_us = record->duration_us;
+	memcpy(buf, &header, sizeof(header));
+
+	size_t offset = sizeof(header);
+	for (int i = 0; i < 4; i++) {
+		memcpy(buf + offset, strings[i], header.string_lengths[i]);
+		offset += header.string_lengths[i];
+	}
+	return length;
+}
+
+int report_write(int fd, const ReportRecord *record) {
+	char stack_buf[4096];
+	char *buf = stack_buf;
+	size_t len = report_encode(record, buf, sizeof(stack_buf));
+	if (len > sizeof(stack_buf)) {
+		if (!(buf = malloc(len)))
+			return -1;
+		report_encode(record, buf, len);
+	}
+
+	// A record is never left half written, the manager could not find the next one
+	size_t done = 0;
+	while (done < len) {
+		ssize_t written = write(fd, buf + done, len - done);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			break;
+		done += written;
+	}
+	if (buf != stack_buf)
+		free(buf);
+	return done == len ? 0 : -1;
+}
+
+ssize_t report_decode(const char *buf, size_t len, ReportRecord *record) {
+	struct report_header header;
+	if (len < sizeof(header))
+		return 0;
+	// The buffer is not necessarily aligned for the header
+	memcpy(&header, buf, sizeof(header));
+	if (header.length < sizeof(header) || header.length > REPORT_MAX_LENGTH)
+		return -1;
+	if (len < header.length)
+		return 0;
+
+	const char *strings[4];
+	size_t offset = sizeof(header);
+	for (int i = 0; i < 4; i++) {
+		uint32_t string_length = header.string_lengths[i];
+		if (string_length == 0 || string_length > header.length - offset || buf[offset + string_length - 1] != '\0')
+			return -1;
+		strings[i] = buf + offset;
+		offset += string_length;
+	}
+	if (offset != header.length)
+		return -1;
+
+	record->type = header.type;
+	record->status = header.status;
+	record->more = (header.flags & REPORT_FLAG_MORE) != 0;
+	record->pid = header.pid;
+	record->files = header.files;
+	record->skipped = header.skipped;
+	record->errors = header.errors;
+	record->timestamp = header.timestamp;
+	record->bytes = header.bytes;
+	record->duration_us = header.duration_us;
+	record->source = strings[0];
+	record->target = strings[1];
+	record->operation = strings[2];
+	record->details = strings[3];
+	return header.length;
+}
+
+void job_field_write(FILE *stream, const char *field) {
+	for (; *field; field++) {
+		if (*field == '\\')
+			fputs("\\\\", stream);
+		else if (*field == '\t')
+			fputs("\\t", stream);
+		else if (*field == '\n')
+			fputs("\\n", stream);
+		else
+			fputc(*field, stream);
+	}
+}
+
+char *job_field_unescape(char *field) {
+	char *out = field;
+	for (const char *in = field; *in; in++) {
+		if (*in == '\\' && in[1]) {
+			in++;
+			*out++ = *in == 't' ? '\t' : *in == 'n' ? '\n' : *in;
+		}
+		else
+			*out++ = *in;
+	}
+	*out = '\0';
+	return field;
+}
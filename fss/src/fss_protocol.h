@@ -0,0 +1,56 @@
+/* File: fss_protocol.h */
+#ifndef FSS_PROTOCOL_H
+#define FSS_PROTOCOL_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Longest record accepted from a worker, anything longer means the stream is corrupt
+#define REPORT_MAX_LENGTH (1024 * 1024)
+
+// Kinds of records a worker sends to the manager
+enum { REPORT_OPERATION = 1, REPORT_BATCH };
+
+enum { REPORT_SUCCESS, REPORT_PARTIAL, REPORT_ERROR, REPORT_STATUS_COUNT };
+
+typedef struct report_record ReportRecord;
+
+// A report of one operation, or the aggregate report that closes a batch. On the wire it is a
+// length-prefixed header with the numbers, followed by the NUL terminated strings
+struct report_record {
+	int type;              // REPORT_OPERATION or REPORT_BATCH
+	int status;            // REPORT_SUCCESS, REPORT_PARTIAL or REPORT_ERROR
+	pid_t pid;
+	long long timestamp;   // seconds since the epoch
+	unsigned int files;    // files copied, for a batch the operations that succeeded
+	unsigned int skipped;  // files that were already up to date
+	unsigned int errors;   // files that failed, for a batch the operations that failed
+	long long bytes;       // bytes written to the target
+	long long duration_us; // time spent on the operation or on the whole batch
+	int more;              // a FULL that stopped after a slice of the files and has to be queued again
+	const char *source;
+	const char *target;
+	const char *operation;
+	const char *details;   // what was done, or the errors
+};
+
+const char *report_status_name(int status);
+
+// Encode record into buf. Returns the length of the record, which is larger than size if it did not fit
+size_t report_encode(const ReportRecord *record, char *buf, size_t size);
+
+// Encode record and write all of it to fd. Returns 0, or -1 with errno set
+int report_write(int fd, const ReportRecord *record);
+
+// Decode the record at the start of the len bytes of buf. Returns its length, 0 if it is not complete yet,
+// or -1 if the data is not a valid record. The strings of record point into buf
+ssize_t report_decode(const char *buf, size_t len, ReportRecord *record);
+
+// Job lines are split on tabs and newlines, which a filename may contain. Write field to stream with a backslash,
+// tab and newline escaped as a backslash followed by '\\', 't' or 'n'
+void job_field_write(FILE *stream, const char *field);
+
+// Undo job_field_write on field in place. Returns field
+char *job_field_unescape(char *field);
+
+#endif
@@ -0,0 +1,69 @@
+/* File: fss_report.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fss_events.h"
+
+// Function to order sources by path, as `sort` does for the script
+static int compare_sources(const void *a, const void *b) {
+	return strcmp((*(EventSource *const *)a)->source, (*(EventSource *const *)b)->source);
+}
+
+int main(int argc, char *argv[]) {
+	const char *logfile = NULL;
+	const char *command = NULL;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "-p") == 0)
+			logfile = argv[i + 1];
+		else if (strcmp(argv[i], "-c") == 0)
+			command = argv[i + 1];
+	}
+	if (!logfile || !command || argc != 5) {
+		fprintf(stderr, "Usage: %s -p <manager_log> -c <listAll|listMonitored|listStopped>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int list_all = strcmp(command, "listAll") == 0;
+	int list_monitored = strcmp(command, "listMonitored") == 0;
+	if (!list_all && !list_monitored && strcmp(command, "listStopped") != 0) {
+		fprintf(stderr, "Invalid command: %s\n", command);
+		exit(EXIT_FAILURE);
+	}
+
+	EventSource *sources;
+	if (event_log_load(logfile, &sources) == -1) {
+		fprintf(stderr, "Error: no event log for %s\n", logfile);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t count = 0;
+	for (EventSource *curr = sources; curr; curr = curr->next)
+		count++;
+	EventSource **sorted = malloc((count ? count : 1) * sizeof(*sorted));
+	count = 0;
+	for (EventSource *curr = sources; curr; curr = curr->next)
+		sorted[count++] = curr;
+	qsort(sorted, count, sizeof(*sorted), compare_sources);
+
+	for (size_t i = 0; i < count; i++) {
+		EventSource *curr = sorted[i];
+		if (!list_all && curr->monitored != list_monitored)
+			continue;
+
+		char last_sync[20] = "N/A";
+		if (curr->last_sync) {
+			time_t t = curr->last_sync;
+			strftime(last_sync, sizeof(last_sync), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		}
+		if (list_all)
+			printf("%s -> %s [Last Sync: %s] [%s]\n", curr->source, curr->target, last_sync,
+				   *curr->result ? curr->result : "UNKNOWN");
+		else
+			printf("%s -> %s [Last Sync: %s]\n", curr->source, curr->target, last_sync);
+	}
+
+	free(sorted);
+	event_sources_free(sources);
+	return 0;
+}
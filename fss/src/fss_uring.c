@@ -0,0 +1,437 @@
+/* File: fss_uring.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "fss_uring.h"
+
+typedef struct ring Ring;
+
+typedef struct uring_file UringFile;
+
+typedef struct uring_slot UringSlot;
+
+// Submission and completion queues shared with the kernel
+struct ring {
+	int fd;
+	unsigned int entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_local_tail; // tail including the entries not handed to the kernel yet
+	unsigned int to_submit;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+enum { FILE_WAITING, FILE_OPENING, FILE_COPYING, FILE_CLOSING, FILE_DONE };
+
+// Progress of one copy job
+struct uring_file {
+	int state;
+	int fds[2];      // source and destination
+	int pending;     // operations in flight
+	int eof;
+	off_t next_offset;
+};
+
+// A buffer carrying one chunk from its read to its write
+struct uring_slot {
+	char *buf;
+	size_t file;
+	off_t offset;
+	unsigned int len;
+	unsigned int done;
+	int busy;
+};
+
+enum { OP_OPEN, OP_READ, OP_WRITE, OP_CLOSE, OP_UNLINK };
+
+// The user data of a submission tells the operation, which of the two fds it is about, and the file or slot
+#define USER_DATA(op, which, index) (((unsigned long long)(op) << 56) | ((unsigned long long)(which) << 48) | (index))
+#define USER_OP(data) ((int)((data) >> 56))
+#define USER_WHICH(data) ((int)(((data) >> 48) & 0xff))
+#define USER_INDEX(data) ((size_t)((data) & 0xffffffffffffULL))
+
+static int ring_setup(Ring *ring, unsigned int entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(*ring));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto fail;
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == MAP_FAILED)
+		goto fail;
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	ring->entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	return 0;
+
+fail:
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	close(ring->fd);
+	return -1;
+}
+
+static void ring_teardown(Ring *ring) {
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+}
+
+// Function to get a zeroed submission entry, NULL if the queue is full
+static struct io_uring_sqe *ring_get_sqe(Ring *ring) {
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->entries)
+		return NULL;
+	unsigned int index = ring->sq_local_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	ring->to_submit++;
+	return sqe;
+}
+
+// Function to hand the new entries to the kernel and wait for at least one completion
+static int ring_submit_and_wait(Ring *ring) {
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret == -1 && errno == EINTR);
+	if (ret >= 0)
+		ring->to_submit -= ret;
+	return ret < 0 ? -1 : 0;
+}
+
+// Function to hand the new entries to the kernel without waiting
+static void ring_flush(Ring *ring) {
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 0, 0, NULL, 0);
+	if (ret >= 0)
+		ring->to_submit -= ret;
+}
+
+// Operations the copies submit. OPENAT and CLOSE need Linux 5.6 and UNLINKAT 5.11, while the ring itself
+// exists since 5.1, so a working io_uring_setup() is not enough
+static const int required_ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE,
+									IORING_OP_UNLINKAT };
+
+int uring_available(void) {
+	Ring ring;
+	if (ring_setup(&ring, 4) == -1)
+		return 0;
+
+	// The probe appeared in 5.6 too, a kernel without it lacks the opcodes anyway
+	size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, probe_size);
+	int available = probe && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	for (size_t i = 0; available && i < sizeof(required_ops) / sizeof(required_ops[0]); i++) {
+		int op = required_ops[i];
+		available = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	ring_teardown(&ring);
+	return available;
+}
+
+// Shared state of a uring_copy_files() call
+typedef struct {
+	Ring ring;
+	UringCopyJob *jobs;
+	UringFile *files;
+	UringSlot *slots;
+	unsigned int slot_count;
+	unsigned int inflight;
+	size_t done_files;
+} CopyRun;
+
+static struct io_uring_sqe *submit(CopyRun *run, int op, int which, size_t index, int fd, const void *addr,
+								   unsigned int len, unsigned long long offset, int open_flags) {
+	// At most twice depth operations are in flight, so the queue only fills up if the kernel has not
+	// consumed what was submitted yet
+	struct io_uring_sqe *sqe;
+	while (!(sqe = ring_get_sqe(&run->ring)))
+		ring_flush(&run->ring);
+	switch (op) {
+	case OP_OPEN:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->open_flags = open_flags;
+		sqe->len = 0644;
+		break;
+	case OP_READ:
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		break;
+	case OP_WRITE:
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = fd;
+		break;
+	case OP_CLOSE:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = fd;
+		break;
+	case OP_UNLINK:
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->fd = AT_FDCWD;
+		break;
+	}
+	sqe->addr = (unsigned long long)(uintptr_t)addr;
+	if (op != OP_OPEN && op != OP_UNLINK)
+		sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = USER_DATA(op, which, index);
+	run->inflight++;
+	return sqe;
+}
+
+static void fail_file(CopyRun *run, size_t index, int error) {
+	if (!run->jobs[index].error)
+		run->jobs[index].error = error;
+	run->jobs[index].result = -1;
+}
+
+// Function to close a file whose operations are over, or to finish it when nothing is open
+static void close_if_idle(CopyRun *run, size_t index) {
+	UringFile *file = &run->files[index];
+	if (file->pending)
+		return;
+	if (file->state == FILE_CLOSING) {
+		file->state = FILE_DONE;
+		run->done_files++;
+		return;
+	}
+	if (file->state == FILE_OPENING && run->jobs[index].result == 0)
+		file->state = FILE_COPYING;
+	if (file->state == FILE_COPYING && !file->eof && run->jobs[index].result == 0)
+		return;
+
+	file->state = FILE_CLOSING;
+	for (int which = 0; which < 2; which++) {
+		if (file->fds[which] >= 0) {
+			submit(run, OP_CLOSE, which, index, file->fds[which], NULL, 0, 0, 0);
+			file->pending++;
+		}
+	}
+	if (!file->pending) {
+		file->state = FILE_DONE;
+		run->done_files++;
+	}
+}
+
+static void handle_completion(CopyRun *run, unsigned long long data, int res) {
+	int op = USER_OP(data), which = USER_WHICH(data);
+	size_t index = USER_INDEX(data);
+	run->inflight--;
+
+	if (op == OP_READ || op == OP_WRITE) {
+		UringSlot *slot = &run->slots[index];
+		index = slot->file;
+		UringFile *file = &run->files[index];
+		file->pending--;
+
+		if (res < 0) {
+			fail_file(run, index, -res);
+			slot->busy = 0;
+		}
+		else if (op == OP_READ && res == 0) {
+			file->eof = 1;
+			slot->busy = 0;
+		}
+		else if (op == OP_READ) {
+			// Regular files only return short reads at the end
+			if ((unsigned int)res < URING_CHUNK_SIZE)
+				file->eof = 1;
+			slot->len = res;
+			slot->done = 0;
+			submit(run, OP_WRITE, 1, slot - run->slots, file->fds[1], slot->buf, slot->len, slot->offset, 0);
+			file->pending++;
+		}
+		else if (res == 0 && slot->done < slot->len) {
+			// A write that makes no progress would leave the target short
+			fail_file(run, index, EIO);
+			slot->busy = 0;
+		}
+		else {
+			slot->done += res;
+			run->jobs[index].bytes_written += res;
+			if (slot->done < slot->len) {
+				submit(run, OP_WRITE, 1, slot - run->slots, file->fds[1], slot->buf + slot->done,
+					   slot->len - slot->done, slot->offset + slot->done, 0);
+				file->pending++;
+			}
+			else {
+				slot->busy = 0;
+			}
+		}
+		close_if_idle(run, index);
+		return;
+	}
+
+	UringFile *file = &run->files[index];
+	file->pending--;
+	if (op == OP_OPEN) {
+		if (res >= 0)
+			file->fds[which] = res;
+		else if (which == 1 && res == -ECANCELED)
+			run->jobs[index].result = -1; // the source open failed and reports the error
+		else
+			fail_file(run, index, -res);
+	}
+	else if (res < 0) {
+		// A failed close may mean that written data was lost; a failed unlink is reported as is
+		fail_file(run, index, -res);
+	}
+	close_if_idle(run, index);
+}
+
+int uring_copy_files(UringCopyJob *jobs, size_t count, unsigned int depth) {
+	CopyRun run;
+	memset(&run, 0, sizeof(run));
+	if (!depth)
+		depth = URING_QUEUE_DEPTH;
+	if (depth < 2)
+		depth = 2; // the two opens of a file go together
+
+	// Room for depth opens and reads, plus the writes and closes that replace them
+	if (ring_setup(&run.ring, depth * 2) == -1)
+		return -1;
+
+	run.jobs = jobs;
+	run.files = calloc(count ? count : 1, sizeof(*run.files));
+	run.slot_count = depth;
+	run.slots = calloc(depth, sizeof(*run.slots));
+	char *buffers = malloc((size_t)depth * URING_CHUNK_SIZE);
+	if (!run.files || !run.slots || !buffers) {
+		free(run.files);
+		free(run.slots);
+		free(buffers);
+		ring_teardown(&run.ring);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (unsigned int i = 0; i < depth; i++)
+		run.slots[i].buf = buffers + (size_t)i * URING_CHUNK_SIZE;
+	for (size_t i = 0; i < count; i++) {
+		jobs[i].result = 0;
+		jobs[i].error = 0;
+		jobs[i].bytes_written = 0;
+		run.files[i].fds[0] = run.files[i].fds[1] = -1;
+	}
+
+	size_t next_file = 0, first_active = 0, open_files = 0;
+	while (run.done_files < count) {
+		// Open the next files, half of the depth at most, so that the reads have slots to use
+		while (next_file < count && open_files < depth / 2 && run.inflight + 2 <= depth) {
+			UringFile *file = &run.files[next_file];
+			if (!jobs[next_file].src) {
+				// Nothing to copy, the unlink is the only operation of the job
+				file->state = FILE_CLOSING;
+				submit(&run, OP_UNLINK, 1, next_file, 0, jobs[next_file].dest, 0, 0, 0);
+				file->pending = 1;
+				next_file++;
+				open_files++;
+				continue;
+			}
+			file->state = FILE_OPENING;
+			// Linked, so that the destination is only truncated once the source could be opened
+			submit(&run, OP_OPEN, 0, next_file, 0, jobs[next_file].src, 0, 0, O_RDONLY | O_CLOEXEC)->flags |= IOSQE_IO_LINK;
+			submit(&run, OP_OPEN, 1, next_file, 0, jobs[next_file].dest, 0, 0, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+			file->pending = 2;
+			next_file++;
+			open_files++;
+		}
+
+		// Give every free buffer a read of the oldest files that still have data to copy
+		while (first_active < next_file && run.files[first_active].state == FILE_DONE)
+			first_active++;
+		size_t candidate = first_active;
+		for (unsigned int i = 0; i < run.slot_count && run.inflight < depth; i++) {
+			UringSlot *slot = &run.slots[i];
+			if (slot->busy)
+				continue;
+			while (candidate < next_file && (run.files[candidate].state != FILE_COPYING || run.files[candidate].eof ||
+											 jobs[candidate].result))
+				candidate++;
+			if (candidate == next_file)
+				break;
+			UringFile *file = &run.files[candidate];
+			slot->busy = 1;
+			slot->file = candidate;
+			slot->offset = file->next_offset;
+			file->next_offset += URING_CHUNK_SIZE;
+			submit(&run, OP_READ, 0, i, file->fds[0], slot->buf, URING_CHUNK_SIZE, slot->offset, 0);
+			file->pending++;
+		}
+
+		if (ring_submit_and_wait(&run.ring) == -1) {
+			// The ring is unusable; whatever was not finished is reported as failed
+			for (size_t i = 0; i < count; i++) {
+				if (run.files[i].state != FILE_DONE)
+					fail_file(&run, i, errno);
+			}
+			break;
+		}
+
+		unsigned int head = *run.ring.cq_head;
+		unsigned int tail = __atomic_load_n(run.ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &run.ring.cqes[head & *run.ring.cq_mask];
+			size_t done_before = run.done_files;
+			handle_completion(&run, cqe->user_data, cqe->res);
+			open_files -= run.done_files - done_before;
+		}
+		__atomic_store_n(run.ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	free(buffers);
+	free(run.slots);
+	free(run.files);
+	ring_teardown(&run.ring);
+	return 0;
+}
@@ -0,0 +1,29 @@
+/* File: fss_uring.h */
+#ifndef FSS_URING_H
+#define FSS_URING_H
+
+// Operations kept in flight by default
+#define URING_QUEUE_DEPTH 64
+
+// Size of the buffers that carry data from the reads to the writes
+#define URING_CHUNK_SIZE (128 * 1024)
+
+typedef struct uring_copy_job UringCopyJob;
+
+// A file to copy; dest is created or truncated. A job without src unlinks dest instead
+struct uring_copy_job {
+	const char *src;         // NULL to unlink dest
+	const char *dest;
+	int result;              // 0 when copied, -1 on error
+	int error;               // errno of the first failed operation
+	long long bytes_written;
+};
+
+// Returns 1 if the kernel lets us use io_uring and supports every operation the copies submit
+int uring_available(void);
+
+// Copy all the jobs through one ring, with the opens, reads, writes, closes and unlinks of many files in flight
+// at once, up to depth operations. Fills the result of every job and returns 0, or -1 if no ring could be set up
+int uring_copy_files(UringCopyJob *jobs, size_t count, unsigned int depth);
+
+#endif
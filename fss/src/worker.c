@@ -9,167 +9,1321 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include "fss_copy.h"
+#include "fss_protocol.h"
+#ifdef FSS_IO_URING
+#include "fss_uring.h"
+#endif
 
-// Function to print the report with the worker tag
-void print_report(const char *status, const char *details, const char *errors,
-    const char *source, const char *target, const char *operation) {
-    time_t now = time(NULL);
+typedef struct sync_counts SyncCounts;
+
+typedef struct file_list FileList;
+
+typedef struct copy_pool CopyPool;
+
+typedef struct file_state FileState;
+
+typedef struct manifest_entry ManifestEntry;
+
+typedef struct manifest Manifest;
+
+typedef struct batch_item BatchItem;
+
+// Name of the manifest kept at the root of every target directory
+#define MANIFEST_NAME ".fss_manifest"
+
+// Last file of the tree that a sliced FULL synchronization has done, kept next to the manifest. Its name
+// starts with the manifest name, so the walk skips it too
+#define CURSOR_NAME ".fss_manifest.cursor"
+
+// Results of a directory synchronization
+struct sync_counts {
+    int success_count;
+    int error_count;
+    int skip_count;
+    int method_counts[COPY_METHOD_COUNT]; // copied files per copy method
+    long long bytes_written;
+    char error_buffer[1000];
+};
+
+// Files of a FULL synchronization, relative to the source
+struct file_list {
+    char **paths;
+    size_t count;
+    size_t capacity;
+};
+
+// State of a source file when it was last copied to the target
+struct file_state {
+    off_t size;
+    struct timespec mtime;
+    ino_t ino;
+    unsigned long long hash; // content hash, 0 when not computed
+};
+
+struct manifest_entry {
+    char *path; // relative to the source
+    FileState state;
+    ManifestEntry *hash_next;
+};
+
+// Files of a target directory as they were when the worker synchronized them, hashed by path
+struct manifest {
+    ManifestEntry **buckets;
+    size_t bucket_count;
+    size_t count;
+};
+
+// One operation of a batch sent by the manager
+struct batch_item {
+    char *operation;
+    char *filename;
+};
+
+// Shared state of the threads that copy the files of a FULL synchronization
+struct copy_pool {
+    const char *source;
+    const char *target;
+    FileList *files;
+    const Manifest *manifest; // what we know about the target, read only while copying
+    FileState *states;        // new manifest state of every file
+    int *results;             // sync_file result of every file
+    size_t next;              // index of the next file to copy
+    SyncCounts *counts;
+    pthread_mutex_t lock;     // protects next and counts
+};
+
+static int copy_threads = 4;  // copies kept in flight by a FULL synchronization
+static int hash_contents = 0; // record content hashes, so a file that was only touched is not copied again
+static long long delta_min_size = 8 * 1024 * 1024; // smallest file updated in place by a delta copy, 0 disables
+static size_t slice_files = 0; // files copied by one FULL job of a whole tree before it yields, 0 for all of them
+static CachePolicy cache_policy = CACHE_KEEP; // how copies use the page cache, set by every batch of the manager
+static long long direct_min_size = DIRECT_MIN_SIZE; // smallest file copied with O_DIRECT by the direct policy
+#ifdef FSS_IO_URING
+static unsigned int uring_depth = URING_QUEUE_DEPTH; // operations in flight for FULL syncs, 0 when io_uring is unusable
+#endif
+static int binary_reports = 0; // reports go to the manager as binary records
+
+// Function to get a monotonic time in microseconds, for the durations of the reports
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Function to print a report. The manager gets binary records; run by hand, the worker prints the
+// report as a line with the worker tag
+void print_report(ReportRecord *record) {
+    record->pid = getpid();
+    record->timestamp = time(NULL);
+
+    if (binary_reports) {
+        if (report_write(STDOUT_FILENO, record) == -1)
+            perror("write report");
+        return;
+    }
+
+    time_t now = record->timestamp;
     struct tm *t = localtime(&now);
     char timestamp[20];
     strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", t);
-    
-    printf("[%s] [WORKER_REPORT] [%s] [%s] [%d] [%s] [%s] [%s]\n", timestamp, source, target,
-        getpid(), operation,status, strcmp(status, "ERROR") ? details : errors);
-    
+
+    if (record->type == REPORT_BATCH)
+        printf("[%s] [WORKER_BATCH] [%s] [%s] [%d] [%u] [%u] [%u]\n", timestamp, record->source, record->target,
+            record->pid, record->files + record->errors, record->files, record->errors);
+    else
+        printf("[%s] [WORKER_REPORT] [%s] [%s] [%d] [%s] [%s] [%s]\n", timestamp, record->source, record->target,
+            record->pid, record->operation, report_status_name(record->status), record->details);
+
     fflush(stdout);
 }
 
-// Function to copy src file to dest file. Returns -1 for error, 0 for copy, 1 for skip
-int sync_file(const char *src, const char *dest) {
-	struct stat src_stat = {0}, dest_stat = {0};
+// Function to create every missing parent directory of path
+void make_parent_dirs(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, 0755);
+        *slash = '/';
+    }
+}
+
+// FNV-1a hash of a string
+size_t hash_path(const char *str) {
+    size_t hash = 14695981039346656037ULL;
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Function to hash the contents of a file, 64 bits at a time. Outside of CACHE_KEEP, what it reads into the page
+// cache is dropped window by window. Returns 0 on error
+unsigned long long hash_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    CacheWindow window;
+    off_t offset = 0;
+    int noted = 0;
+    if (cache_policy != CACHE_KEEP)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+    static __thread unsigned long long *buf = NULL;
+    if (!buf && !(buf = malloc(COPY_BUFFER_SIZE))) {
+        close(fd);
+        return 0;
+    }
+
+    unsigned long long hash = 0x9e3779b97f4a7c15ULL;
+    ssize_t bytes;
+    while (1) {
+        if (cache_policy != CACHE_KEEP && !noted) {
+            cache_window_note(&window, fd, offset, STREAM_WINDOW, 1, NULL);
+            noted = 1;
+        }
+        if ((bytes = read(fd, buf, COPY_BUFFER_SIZE)) <= 0)
+            break;
+        offset += bytes;
+        if (noted && offset >= window.offset + STREAM_WINDOW) {
+            cache_window_drop(&window, fd, NULL);
+            noted = 0;
+        }
+
+        // Zero the tail of the last word so the hash only depends on the bytes read
+        if (bytes % sizeof(*buf))
+            memset((char *)buf + bytes, 0, sizeof(*buf) - bytes % sizeof(*buf));
+        for (size_t i = 0; i < (bytes + sizeof(*buf) - 1) / sizeof(*buf); i++) {
+            hash ^= buf[i];
+            hash *= 0x100000001b3ULL;
+            hash ^= hash >> 29;
+        }
+        hash ^= bytes;
+    }
+    if (noted)
+        cache_window_drop(&window, fd, NULL);
+    close(fd);
+    return bytes == 0 && hash ? hash : 0;
+}
+
+ManifestEntry *manifest_find(const Manifest *manifest, const char *path) {
+    if (!manifest || !manifest->bucket_count)
+        return NULL;
+    ManifestEntry *curr = manifest->buckets[hash_path(path) % manifest->bucket_count];
+    while (curr) {
+        if (!strcmp(curr->path, path))
+            return curr;
+        curr = curr->hash_next;
+    }
+    return NULL;
+}
+
+// Function to add or replace the entry of path
+void manifest_set(Manifest *manifest, const char *path, const FileState *state) {
+    ManifestEntry *entry = manifest_find(manifest, path);
+    if (entry) {
+        entry->state = *state;
+        return;
+    }
+
+    if (manifest->count >= manifest->bucket_count) {
+        // Grow the bucket array
+        size_t count = manifest->bucket_count ? manifest->bucket_count * 2 : 1024;
+        ManifestEntry **buckets = calloc(count, sizeof(*buckets));
+        for (size_t i = 0; i < manifest->bucket_count; i++) {
+            ManifestEntry *curr = manifest->buckets[i];
+            while (curr) {
+                ManifestEntry *next = curr->hash_next;
+                size_t bucket = hash_path(curr->path) % count;
+                curr->hash_next = buckets[bucket];
+                buckets[bucket] = curr;
+                curr = next;
+            }
+        }
+        free(manifest->buckets);
+        manifest->buckets = buckets;
+        manifest->bucket_count = count;
+    }
+
+    entry = malloc(sizeof(*entry));
+    entry->path = strdup(path);
+    entry->state = *state;
+    size_t bucket = hash_path(path) % manifest->bucket_count;
+    entry->hash_next = manifest->buckets[bucket];
+    manifest->buckets[bucket] = entry;
+    manifest->count++;
+}
+
+void manifest_remove(Manifest *manifest, const char *path) {
+    if (!manifest->bucket_count)
+        return;
+    ManifestEntry **link = &manifest->buckets[hash_path(path) % manifest->bucket_count];
+    while (*link) {
+        if (!strcmp((*link)->path, path)) {
+            ManifestEntry *entry = *link;
+            *link = entry->hash_next;
+            free(entry->path);
+            free(entry);
+            manifest->count--;
+            return;
+        }
+        link = &(*link)->hash_next;
+    }
+}
+
+void free_manifest(Manifest *manifest) {
+    for (size_t i = 0; i < manifest->bucket_count; i++) {
+        ManifestEntry *curr = manifest->buckets[i];
+        while (curr) {
+            ManifestEntry *next = curr->hash_next;
+            free(curr->path);
+            free(curr);
+            curr = next;
+        }
+    }
+    free(manifest->buckets);
+}
+
+// Function to load the manifest of a target. It is a log of "F <size> <sec> <nsec> <ino> <hash> <path>"
+// and "D <path>" records, where later records win. A missing or damaged manifest only costs extra checks
+void load_manifest(const char *target, Manifest *manifest) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", target, MANIFEST_NAME);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return;
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        FileState state;
+        long long size, sec, nsec, ino;
+        int offset = 0;
+        if (line[0] == 'D' && line[1] == ' ') {
+            manifest_remove(manifest, line + 2);
+        }
+        else if (sscanf(line, "F %lld %lld %lld %lld %llx %n", &size, &sec, &nsec, &ino, &state.hash, &offset) == 5 && offset) {
+            state.size = size;
+            state.mtime.tv_sec = sec;
+            state.mtime.tv_nsec = nsec;
+            state.ino = ino;
+            manifest_set(manifest, line + offset, &state);
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+// Function to format the manifest record of a file, or the deletion record when state is NULL
+int format_manifest_record(char *buf, size_t size, const char *path, const FileState *state) {
+    if (!state)
+        return snprintf(buf, size, "D %s\n", path);
+    return snprintf(buf, size, "F %lld %lld %ld %llu %llx %s\n", (long long)state->size, (long long)state->mtime.tv_sec,
+                    state->mtime.tv_nsec, (unsigned long long)state->ino, state->hash, path);
+}
+
+// Function to append one record to the manifest of a target. O_APPEND keeps the records of
+// concurrent workers whole
+void append_manifest_record(const char *target, const char *path, const FileState *state) {
+    char manifest_path[PATH_MAX], record[PATH_MAX + 200];
+    snprintf(manifest_path, sizeof(manifest_path), "%s/%s", target, MANIFEST_NAME);
+    int len = format_manifest_record(record, sizeof(record), path, state);
+    if (len >= (int)sizeof(record) || strchr(path, '\n'))
+        return;
+
+    int fd = open(manifest_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1)
+        return;
+    if (write(fd, record, len) != len) {
+        // A short record is ignored when the manifest is loaded
+    }
+    close(fd);
+}
+
+// Function to replace the manifest of a target with the given entries, dropping the history
+void write_manifest(const char *target, const Manifest *manifest) {
+    char manifest_path[PATH_MAX], tmp_path[PATH_MAX + 8];
+    snprintf(manifest_path, sizeof(manifest_path), "%s/%s", target, MANIFEST_NAME);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", manifest_path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp)
+        return;
+    char record[PATH_MAX + 200];
+    for (size_t i = 0; i < manifest->bucket_count; i++) {
+        for (ManifestEntry *curr = manifest->buckets[i]; curr; curr = curr->hash_next) {
+            if (format_manifest_record(record, sizeof(record), curr->path, &curr->state) < (int)sizeof(record) &&
+                !strchr(curr->path, '\n'))
+                fputs(record, fp);
+        }
+    }
+    if (fclose(fp) == 0)
+        rename(tmp_path, manifest_path);
+    else
+        unlink(tmp_path);
+}
+
+int same_mtime(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
 
-	if (stat(src, &src_stat)) {
+// Function to decide whether src file has to be copied to dest. Returns -1 for error, 0 for copy, 1 for skip.
+// known is the manifest entry of the file, if any, and state receives what the manifest should record.
+// On copy, src_stat holds the source and delta tells whether the target should be patched in place
+int check_file(const char *src, const char *dest, const FileState *known, FileState *state,
+               struct stat *src_stat, int *delta) {
+	struct stat dest_stat;
+
+	if (stat(src, src_stat)) {
         return -1;
     }
-	else {
-        // If src and dest files have same size and modification time, they are identical
-        if (src_stat.st_size == dest_stat.st_size && 
-            src_stat.st_mtime <= dest_stat.st_mtime) {
+    state->size = src_stat->st_size;
+    state->mtime = src_stat->st_mtim;
+    state->ino = src_stat->st_ino;
+    state->hash = 0;
+
+    int dest_exists = !stat(dest, &dest_stat) && S_ISREG(dest_stat.st_mode);
+    if (dest_exists && dest_stat.st_size == src_stat->st_size) {
+        // Targets get the modification time of their source, so same size and time means identical,
+        // unless the manifest tells that the source is another file than the one copied
+        if (same_mtime(&src_stat->st_mtim, &dest_stat.st_mtim) &&
+            (!known || (known->ino == src_stat->st_ino && known->size == src_stat->st_size &&
+                        same_mtime(&known->mtime, &src_stat->st_mtim)))) {
+            state->hash = known ? known->hash : 0;
+            return 1;
+        }
+
+        // Only the time changed, e.g. touch: the content hash avoids the copy
+        if (hash_contents && known && known->hash && known->size == src_stat->st_size &&
+            (state->hash = hash_file(src)) == known->hash) {
+            struct timespec times[2] = { src_stat->st_atim, src_stat->st_mtim };
+            utimensat(AT_FDCWD, dest, times, 0);
             return 1;
         }
     }
 
-    char path[50];
-    snprintf(path, sizeof(path), "%s", dest);
-    char *slash = strrchr(path, '/');
-    if (slash) {
-		// If needed we create a parent directory for destination
-        *slash ='\0';
-        mkdir(path, 0755);
+    // A large target that is mostly the same as its source is patched in place instead of rewritten,
+    // unless it is so much shorter that most of it has to be written anyway
+    *delta = delta_min_size && dest_exists && src_stat->st_size >= delta_min_size &&
+             dest_stat.st_size >= src_stat->st_size / 2;
+    return 0;
+}
+
+// Function to copy src file to dest file. Returns -1 for error, 0 for copy, 1 for skip.
+// known is the manifest entry of the file, if any, and state receives what the manifest should
+// record. On copy what the copy engine did is stored in stats
+int sync_file(const char *src, const char *dest, const FileState *known, FileState *state, CopyStats *stats) {
+	struct stat src_stat;
+    int delta;
+
+    int check = check_file(src, dest, known, state, &src_stat, &delta);
+    if (check != 0) {
+        return check;
     }
 
+    // If needed we create the parent directories for destination
+    make_parent_dirs(dest);
+
     int src_fd = open(src, O_RDONLY);
     if (src_fd == -1) {
         return -1;
     }
     
-    int dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int dest_fd = open(dest, delta ? O_RDWR : O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (dest_fd == -1) {
         close(src_fd);
         return -1;
     }
 
-    char buf[4000];
-    ssize_t bytes;
-	// Read bytes from the source file and write them to the destination
-    while((bytes = read(src_fd, buf, sizeof(buf))) > 0) {
-        if (write(dest_fd, buf, bytes) != bytes) {
-            close(src_fd);
-            close(dest_fd);
-            return -1;
-        }
+    // Let the copy engine pick the cheapest way the filesystems support
+    int result = delta ? delta_copy_fd(src_fd, dest_fd, cache_policy, stats)
+                       : copy_fd_cached(src_fd, dest_fd, cache_policy, direct_min_size, stats);
+    int saved_errno = errno;
+
+    // Preserve the modification time, it is what tells later syncs that the target is up to date
+    if (result == 0) {
+        struct timespec times[2] = { src_stat.st_atim, src_stat.st_mtim };
+        futimens(dest_fd, times);
+        if (hash_contents && !state->hash)
+            state->hash = hash_file(src);
     }
 
     close(src_fd);
     close(dest_fd);
-    return 0;
+    errno = saved_errno;
+    return result;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <source> <target> <filename> <operation>\n", argv[0]);
-        exit(EXIT_FAILURE);
+// Function to add an error message for path in the counts
+void add_sync_error(SyncCounts *counts, const char *kind, const char *path) {
+    size_t used = strlen(counts->error_buffer);
+    counts->error_count++;
+    snprintf(counts->error_buffer + used, sizeof(counts->error_buffer) - used, "%s %s: %s", kind, path, strerror(errno));
+}
+
+// Function to describe the copy methods used, e.g. " (reflink: 2, read_write: 1)"
+void format_copy_methods(char *buf, size_t size, const int *method_counts) {
+    size_t used = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < COPY_METHOD_COUNT && used < size; i++) {
+        if (method_counts[i])
+            used += snprintf(buf + used, size - used, "%s%s: %d", used ? ", " : " (",
+                             copy_method_name(i), method_counts[i]);
     }
+    if (used && used < size)
+        snprintf(buf + used, size - used, ")");
+}
 
-    char *source = argv[1];
-    char *target = argv[2];
-    char *filename = argv[3];
-    char *operation = argv[4];
+void add_file(FileList *files, const char *rel_path) {
+    if (files->count == files->capacity) {
+        files->capacity = files->capacity ? files->capacity * 2 : 256;
+        files->paths = realloc(files->paths, files->capacity * sizeof(*files->paths));
+    }
+    files->paths[files->count++] = strdup(rel_path);
+}
 
-    int success_count = 0, error_count = 0, skip_count = 0;
-    char details[1000] = {0}, error_buffer[1000] = {0};
+void free_file_list(FileList *files) {
+    for (size_t i = 0; i < files->count; i++)
+        free(files->paths[i]);
+    free(files->paths);
+}
 
-    if (strcmp(operation, "FULL") == 0) {
-		// Full directory synchronization
-        DIR *dir = opendir(source);
-        if (!dir) {
-            exit(EXIT_FAILURE);
+// An entry of a directory being walked
+typedef struct {
+    char *name;
+    int is_dir;
+} WalkEntry;
+
+// Sorts the entries of a directory so that the walk yields the paths below it in strcmp() order: a directory
+// sorts as its name followed by '/', which is what the paths inside it start with
+int compare_walk_entries(const void *a, const void *b) {
+    const WalkEntry *x = a, *y = b;
+    const unsigned char *p = (const unsigned char *)x->name, *q = (const unsigned char *)y->name;
+    while (*p && *p == *q) {
+        p++;
+        q++;
+    }
+    int c = *p ? *p : x->is_dir ? '/' : 0;
+    int d = *q ? *q : y->is_dir ? '/' : 0;
+    return c - d;
+}
+
+// Function to walk the tree under rel_path ("" for the whole source) recursively, creating the target
+// directories on the way and collecting the files to synchronize. With a cursor ("" for the start), the walk
+// goes in sorted path order, leaves out what sorts at or before the cursor and stops at limit files
+void collect_files(const char *source, const char *target, const char *rel_path, const char *cursor, size_t limit,
+                   FileList *files, SyncCounts *counts) {
+    char src_dir[PATH_MAX];
+    snprintf(src_dir, sizeof(src_dir), "%s%s%s", source, *rel_path ? "/" : "", rel_path);
+
+    DIR *dir = opendir(src_dir);
+    if (!dir) {
+        add_sync_error(counts, "Directory", *rel_path ? rel_path : source);
+        return;
+    }
+
+    // Read the directory first, so that it can be sorted and no descriptor stays open on the way down
+    WalkEntry *entries = NULL;
+    size_t entry_count = 0, entry_capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+		// Skip current and previous directory entries
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        // A source that is itself a target keeps its manifest to itself
+        if (!*rel_path && !strncmp(entry->d_name, MANIFEST_NAME, strlen(MANIFEST_NAME))) {
+            continue;
         }
 
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
-			// Skip current and previous directory entries
-            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+        // Symbolic links to directories are not followed, so the walk cannot loop. Only a filesystem that
+        // does not fill d_type costs an lstat() per entry
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            char src_path[PATH_MAX];
+            struct stat st;
+            if (snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, entry->d_name) >= (int)sizeof(src_path)) {
+                errno = ENAMETOOLONG;
+                add_sync_error(counts, "File", entry->d_name);
                 continue;
             }
+            if (lstat(src_path, &st)) {
+                add_sync_error(counts, "File", entry->d_name);
+                continue;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (entry_count == entry_capacity) {
+            entry_capacity = entry_capacity ? entry_capacity * 2 : 64;
+            entries = realloc(entries, entry_capacity * sizeof(*entries));
+        }
+        entries[entry_count].name = strdup(entry->d_name);
+        entries[entry_count++].is_dir = is_dir;
+    }
+    closedir(dir);
+    if (cursor)
+        qsort(entries, entry_count, sizeof(*entries), compare_walk_entries);
 
-            char src_path[300], dest_path[300];
-            snprintf(src_path, sizeof(src_path), "%s/%s", source, entry->d_name);
-            snprintf(dest_path, sizeof(dest_path), "%s/%s", target, entry->d_name);
-            
-            int result = sync_file(src_path, dest_path);
-            if (result == 0) {
-				// File copied
-                success_count++;
-            } else if (result == 1) {
-				// File skipped
-                skip_count++;
+    for (size_t i = 0; i < entry_count && !(cursor && files->count >= limit); i++) {
+        char rel_entry[PATH_MAX], dest_path[PATH_MAX];
+        if (snprintf(rel_entry, sizeof(rel_entry), "%s%s%s", rel_path, *rel_path ? "/" : "", entries[i].name) >= (int)sizeof(rel_entry) ||
+            snprintf(dest_path, sizeof(dest_path), "%s/%s", target, rel_entry) >= (int)sizeof(dest_path)) {
+            errno = ENAMETOOLONG;
+            add_sync_error(counts, "File", entries[i].name);
+            continue;
+        }
+
+        if (entries[i].is_dir) {
+            if (cursor) {
+                // Compare "<rel_entry>/" with the cursor: below 0 everything inside sorts before it
+                size_t len = strlen(rel_entry);
+                int cmp = strncmp(rel_entry, cursor, len);
+                if (!cmp)
+                    cmp = '/' - (unsigned char)cursor[len];
+                if (cmp < 0)
+                    continue;
             }
-			else {
-				// Error
-                error_count++;
-                char error_msg[300];
-                snprintf(error_msg, sizeof(error_msg), "File %s: %s", entry->d_name, strerror(errno));
-                strncat(error_buffer, error_msg, sizeof(error_buffer) - strlen(error_buffer) - 1);
+            make_parent_dirs(dest_path);
+            mkdir(dest_path, 0755);
+            collect_files(source, target, rel_entry, cursor, limit, files, counts);
+            continue;
+        }
+        if (!cursor || strcmp(rel_entry, cursor) > 0)
+            add_file(files, rel_entry);
+    }
+    for (size_t i = 0; i < entry_count; i++)
+        free(entries[i].name);
+    free(entries);
+}
+
+// Function to add the result of one file of a FULL synchronization in the counts
+void count_result(SyncCounts *counts, int result, const CopyStats *stats, const char *rel_path) {
+    if (result == 0) {
+		// File copied
+        counts->success_count++;
+        counts->method_counts[stats->method]++;
+        counts->bytes_written += stats->bytes_written;
+    } else if (result == 1) {
+		// File skipped
+        counts->skip_count++;
+    }
+	else {
+		// Error
+        add_sync_error(counts, "File", rel_path);
+    }
+}
+
+// Thread body: copy the next file of the list until none is left
+void *copy_thread(void *arg) {
+    CopyPool *pool = arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        size_t index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (index >= pool->files->count)
+            break;
+
+        const char *rel_path = pool->files->paths[index];
+        char src_path[PATH_MAX], dest_path[PATH_MAX];
+        snprintf(src_path, sizeof(src_path), "%s/%s", pool->source, rel_path);
+        snprintf(dest_path, sizeof(dest_path), "%s/%s", pool->target, rel_path);
+
+        CopyStats stats;
+        ManifestEntry *known = manifest_find(pool->manifest, rel_path);
+        int result = sync_file(src_path, dest_path, known ? &known->state : NULL, &pool->states[index], &stats);
+        pool->results[index] = result;
+
+        pthread_mutex_lock(&pool->lock);
+        count_result(pool->counts, result, &stats, rel_path);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+#ifdef FSS_IO_URING
+// Function to copy the files of a FULL synchronization through one io_uring, so that the data of many
+// files is in flight at once. Files for a delta copy go through sync_file(). Returns -1 if no ring could be set up
+int sync_files_uring(CopyPool *pool) {
+    FileList *files = pool->files;
+    UringCopyJob *jobs = calloc(files->count ? files->count : 1, sizeof(*jobs));
+    size_t *job_files = calloc(files->count ? files->count : 1, sizeof(*job_files));
+    size_t job_count = 0;
+
+    for (size_t i = 0; i < files->count; i++) {
+        char src_path[PATH_MAX], dest_path[PATH_MAX];
+        snprintf(src_path, sizeof(src_path), "%s/%s", pool->source, files->paths[i]);
+        snprintf(dest_path, sizeof(dest_path), "%s/%s", pool->target, files->paths[i]);
+
+        ManifestEntry *known = manifest_find(pool->manifest, files->paths[i]);
+        struct stat src_stat;
+        int delta = 0;
+        CopyStats stats = { COPY_READ_WRITE, 0 };
+        int result = check_file(src_path, dest_path, known ? &known->state : NULL, &pool->states[i], &src_stat, &delta);
+        if (result == 0 && delta)
+            result = sync_file(src_path, dest_path, known ? &known->state : NULL, &pool->states[i], &stats);
+        else if (result == 0) {
+            jobs[job_count].src = strdup(src_path);
+            jobs[job_count].dest = strdup(dest_path);
+            job_files[job_count++] = i;
+            continue;
+        }
+        pool->results[i] = result;
+        count_result(pool->counts, result, &stats, files->paths[i]);
+    }
+
+    int ret = uring_copy_files(jobs, job_count, uring_depth);
+    for (size_t j = 0; j < job_count; j++) {
+        size_t i = job_files[j];
+        CopyStats stats = { COPY_IO_URING, jobs[j].bytes_written };
+        int result;
+        if (ret == -1) {
+            // The ring could not be set up after all: copy these ones the usual way
+            ManifestEntry *known = manifest_find(pool->manifest, files->paths[i]);
+            result = sync_file(jobs[j].src, jobs[j].dest, known ? &known->state : NULL, &pool->states[i], &stats);
+        }
+        else if ((result = jobs[j].result) == 0) {
+            // Preserve the modification time, it is what tells later syncs that the target is up to date
+            struct timespec times[2] = { { 0, UTIME_OMIT }, pool->states[i].mtime };
+            utimensat(AT_FDCWD, jobs[j].dest, times, 0);
+            if (hash_contents)
+                pool->states[i].hash = hash_file(jobs[j].src);
+        }
+        else {
+            errno = jobs[j].error;
+        }
+        pool->results[i] = result;
+        count_result(pool->counts, result, &stats, files->paths[i]);
+        free((char *)jobs[j].src);
+        free((char *)jobs[j].dest);
+    }
+    free(jobs);
+    free(job_files);
+    return 0;
+}
+#endif
+
+// Function to read the cursor of the sliced FULL synchronization of target into cursor, "" if there is none
+void read_cursor(const char *target, char *cursor, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", target, CURSOR_NAME);
+    cursor[0] = '\0';
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return;
+    if (fgets(cursor, size, fp))
+        cursor[strcspn(cursor, "\n")] = '\0';
+    fclose(fp);
+}
+
+// Function to store the cursor of the sliced FULL synchronization of target, or to remove it when cursor is NULL
+void write_cursor(const char *target, const char *cursor) {
+    char path[PATH_MAX], tmp_path[PATH_MAX + 8];
+    snprintf(path, sizeof(path), "%s/%s", target, CURSOR_NAME);
+    if (!cursor) {
+        unlink(path);
+        return;
+    }
+    // Write a new file and rename it over the old one, so a crash leaves one cursor or the other
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp)
+        return;
+    fprintf(fp, "%s\n", cursor);
+    if (fclose(fp) == 0)
+        rename(tmp_path, path);
+}
+
+// Function to synchronize the files of a directory tree, rel_path being "" for the whole source, keeping up to
+// copy_threads copies in flight. Files that the manifest of the target knows unchanged are skipped. With slices,
+// a FULL of the whole tree copies the first slice_files files in sorted order, or with resume the next ones after
+// the cursor, and sets more if files are left for another job
+void sync_directory(const char *source, const char *target, const char *rel_path, int resume, SyncCounts *counts,
+                    int *more) {
+    FileList files = {0};
+    Manifest manifest = {0};
+    mkdir(target, 0755);
+    load_manifest(target, &manifest);
+    *more = 0;
+
+    int sliced = !*rel_path && slice_files;
+    char cursor[PATH_MAX] = "";
+    if (sliced) {
+        // A new FULL starts over: a cursor left by a crash or a cancel would skip the files changed since
+        if (resume)
+            read_cursor(target, cursor, sizeof(cursor));
+        else
+            write_cursor(target, NULL);
+    }
+    // A sorted walk is the same from one job to the next, so a slice only visits the paths after the cursor, up
+    // to its own files and one more that tells whether another job has to follow
+    collect_files(source, target, rel_path, sliced ? cursor : NULL, slice_files + 1, &files, counts);
+    if (sliced && files.count > slice_files) {
+        free(files.paths[--files.count]);
+        *more = 1;
+    }
+
+    FileState *states = calloc(files.count ? files.count : 1, sizeof(*states));
+    int *results = calloc(files.count ? files.count : 1, sizeof(*results));
+    CopyPool pool = { source, target, &files, &manifest, states, results, 0, counts, PTHREAD_MUTEX_INITIALIZER };
+#ifdef FSS_IO_URING
+    if (uring_depth && files.count && cache_policy == CACHE_KEEP) {
+        sync_files_uring(&pool);
+    }
+    else
+#endif
+    {
+        size_t thread_count = (size_t)copy_threads < files.count ? (size_t)copy_threads : files.count;
+        pthread_t threads[thread_count ? thread_count : 1];
+        size_t started = 0;
+
+        for (; started + 1 < thread_count; started++) {
+            if (pthread_create(&threads[started], NULL, copy_thread, &pool))
+                break;
+        }
+        // This thread copies too; it is the only one when threads cannot be created
+        copy_thread(&pool);
+        for (size_t i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+
+    if (*rel_path || *more) {
+        // Only a subtree, or a slice, was synchronized: the rest of the manifest stays as it is
+        for (size_t i = 0; i < files.count; i++) {
+            if (results[i] == 0 || (results[i] == 1 && !manifest_find(&manifest, files.paths[i])))
+                append_manifest_record(target, files.paths[i], &states[i]);
+        }
+        if (*more)
+            write_cursor(target, files.paths[files.count - 1]);
+    }
+    else {
+        // The whole tree was walked: the new manifest holds exactly the files that are in sync. The files
+        // of the earlier slices keep what those recorded, as long as the source still has them
+        Manifest synced = {0};
+        for (size_t bucket = 0; cursor[0] && bucket < manifest.bucket_count; bucket++) {
+            for (ManifestEntry *known = manifest.buckets[bucket]; known; known = known->hash_next) {
+                char src_path[PATH_MAX];
+                struct stat st;
+                if (strcmp(known->path, cursor) <= 0 &&
+                    snprintf(src_path, sizeof(src_path), "%s/%s", source, known->path) < (int)sizeof(src_path) &&
+                    lstat(src_path, &st) == 0 && !S_ISDIR(st.st_mode))
+                    manifest_set(&synced, known->path, &known->state);
             }
         }
-        closedir(dir);
+        for (size_t i = 0; i < files.count; i++) {
+            if (results[i] != -1)
+                manifest_set(&synced, files.paths[i], &states[i]);
+        }
+        write_manifest(target, &synced);
+        write_cursor(target, NULL);
+        free_manifest(&synced);
+    }
+
+    free_manifest(&manifest);
+    free(states);
+    free(results);
+    free_file_list(&files);
+}
+
+// Function to remove path and, when it is a directory, everything below it
+int remove_tree(const char *path) {
+    struct stat st;
+    if (lstat(path, &st))
+        return -1;
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path);
+
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        remove_tree(child);
+    }
+    closedir(dir);
+    return rmdir(path);
+}
+
+// Function to record the result of an ADDED or MODIFIED operation and fill its report, with the
+// details written in the size bytes of details
+void fill_copy_report(ReportRecord *record, char *details, size_t size, const char *filename,
+                      int result, const CopyStats *stats, const FileState *state) {
+    record->details = details;
+    if (result != -1)
+        append_manifest_record(record->target, filename, state);
+    if (result == 0 && stats->method == COPY_DELTA) {
+        snprintf(details, size, "File: %s (delta: %lld of %lld bytes written)", filename,
+                 stats->bytes_written, (long long)state->size);
+    } else if (result == 0) {
+        snprintf(details, size, "File: %s (%s)", filename, copy_method_name(stats->method));
+    } else if (result == 1) {
+        snprintf(details, size, "File: %s (unchanged)", filename);
+    } else {
+        snprintf(details, size, "File %s: %s", filename, strerror(errno));
+    }
+    record->status = result == -1 ? REPORT_ERROR : REPORT_SUCCESS;
+    record->files = result == 0;
+    record->skipped = result == 1;
+    record->errors = result == -1;
+    record->bytes = result == 0 ? stats->bytes_written : 0;
+}
+
+// Function to record the result of a DELETED operation and fill its report
+void fill_delete_report(ReportRecord *record, char *details, size_t size, const char *filename, int result) {
+    record->details = details;
+    // If the destination is already gone we are done
+    if (result == 0 || errno == ENOENT) {
+        append_manifest_record(record->target, filename, NULL);
+        snprintf(details, size, "File: %s", filename);
+        record->status = REPORT_SUCCESS;
+        record->files = 1;
+    }
+    else {
+        // If deletion fails report the error
+        snprintf(details, size, "File %s: %s", filename, strerror(errno));
+        record->status = REPORT_ERROR;
+        record->errors = 1;
+    }
+}
+
+// Function to rename old_name to new_name in the target and fill the report. A target entry in the way is
+// replaced. Returns 0, or -1 with errno set; nothing is reported if the target does not have old_name (ENOENT)
+int rename_target(const char *source, const char *target, const char *old_name, const char *new_name,
+                  ReportRecord *record, char *details, size_t size) {
+    char old_path[PATH_MAX], new_path[PATH_MAX], src_path[PATH_MAX];
+    snprintf(old_path, sizeof(old_path), "%s/%s", target, old_name);
+    snprintf(new_path, sizeof(new_path), "%s/%s", target, new_name);
+    snprintf(src_path, sizeof(src_path), "%s/%s", source, new_name);
+
+    make_parent_dirs(new_path);
+    int result = rename(old_path, new_path);
+    // Only these errors mean an entry is in the way, any other one (EACCES, EXDEV, EROFS...) must not cost its data
+    if (result == -1 && (errno == EISDIR || errno == ENOTEMPTY || errno == EEXIST || errno == ENOTDIR)) {
+        int saved_errno = errno;
+        if (remove_tree(new_path) == 0)
+            result = rename(old_path, new_path);
+        else
+            errno = saved_errno;
+    }
+    if (result == -1 && errno == ENOENT)
+        return -1;
+
+    record->details = details;
+    if (result == -1) {
+        snprintf(details, size, "File %s: %s", old_name, strerror(errno));
+        record->status = REPORT_ERROR;
+        record->errors = 1;
+        return -1;
+    }
+
+    // A rename keeps the inode and the times of the source, so the manifest entry moves along
+    struct stat st;
+    append_manifest_record(target, old_name, NULL);
+    if (lstat(src_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        FileState state = { st.st_size, st.st_mtim, st.st_ino, 0 };
+        append_manifest_record(target, new_name, &state);
+    }
+    snprintf(details, size, "File: %s -> %s (renamed)", old_name, new_name);
+    record->files = 1;
+    return 0;
+}
+
+// Function to count the report of an operation in the report of its batch
+void add_to_batch(ReportRecord *batch, const ReportRecord *record) {
+    if (record->status == REPORT_ERROR)
+        batch->errors++;
+    else
+        batch->files++;
+    batch->skipped += record->skipped;
+    batch->bytes += record->bytes;
+}
+
+// Function to execute a single <source> <target> <filename> <operation> job, print its report and count
+// it in batch
+void run_job(const char *source, const char *target, const char *filename, const char *operation,
+             ReportRecord *batch) {
+    char details[PATH_MAX * 2 + 1100];
+    ReportRecord record = { REPORT_OPERATION, REPORT_SUCCESS };
+    record.source = source;
+    record.target = target;
+    record.operation = operation;
+    record.details = details;
+    long long start = now_us();
+
+    if (strcmp(operation, "RENAMED") == 0) {
+        // The filename is "<old path>\t<new path>", both escaped as in a job line
+        char old_name[PATH_MAX], new_name[PATH_MAX];
+        const char *tab = strchr(filename, '\t');
+        if (!tab) {
+            snprintf(details, sizeof(details), "Malformed rename %s", filename);
+            record.status = REPORT_ERROR;
+            record.errors = 1;
+        }
+        else {
+            snprintf(old_name, sizeof(old_name), "%.*s", (int)(tab - filename), filename);
+            snprintf(new_name, sizeof(new_name), "%s", tab + 1);
+            job_field_unescape(old_name);
+            job_field_unescape(new_name);
+            if (rename_target(source, target, old_name, new_name, &record, details, sizeof(details)) == -1 && errno == ENOENT) {
+                // The target never got the old path, the new one is copied instead
+                char src_path[PATH_MAX * 2];
+                struct stat st;
+                snprintf(src_path, sizeof(src_path), "%s/%s", source, new_name);
+                int is_dir = lstat(src_path, &st) == 0 && S_ISDIR(st.st_mode);
+                run_job(source, target, new_name, is_dir ? "FULL" : "ADDED", batch);
+                return;
+            }
+        }
+    }
+    else if (strcmp(operation, "FULL") == 0 || strcmp(operation, "RESUME") == 0) {
+		// Full synchronization of the whole source, or of one of its subdirectories
+        SyncCounts counts = {0};
+        sync_directory(source, target, strcmp(filename, "ALL") ? filename : "", !strcmp(operation, "RESUME"), &counts,
+                       &record.more);
         
 		// Generate corresponding report
-        if (error_count == 0 && skip_count == 0) {
-			snprintf(details, sizeof(details), "%d files copied", success_count);
-			print_report("SUCCESS", details, NULL, source, target, operation);
+        char methods[200];
+        format_copy_methods(methods, sizeof(methods), counts.method_counts);
+        const char *rest = record.more ? ", more to follow" : "";
+        if (counts.error_count == 0 && counts.skip_count == 0) {
+			snprintf(details, sizeof(details), "%d files copied%s%s", counts.success_count, methods, rest);
 		} 
-		else if (error_count == 0) {
-			snprintf(details, sizeof(details), "%d files copied, %d skipped", success_count, skip_count);
-			print_report("PARTIAL", details, NULL, source, target, operation);
+		else if (counts.error_count == 0) {
+			snprintf(details, sizeof(details), "%d files copied, %d skipped%s%s", counts.success_count, counts.skip_count, methods, rest);
+			record.status = REPORT_PARTIAL;
 		}
 		else {
-			print_report("ERROR", NULL, error_buffer, source, target, operation);
-		}		
+			snprintf(details, sizeof(details), "%s", counts.error_buffer);
+			record.status = REPORT_ERROR;
+		}
+		record.files = counts.success_count;
+		record.skipped = counts.skip_count;
+		record.errors = counts.error_count;
+		record.bytes = counts.bytes_written;
     }
     else {
-		// Single file operations: ADDED, MODIFIED, or DELETED
-        char src_path[300], dest_path[300];
+        // Single file operations: ADDED, MODIFIED, or DELETED
+        char src_path[PATH_MAX], dest_path[PATH_MAX];
         snprintf(src_path, sizeof(src_path), "%s/%s", source, filename);
         snprintf(dest_path, sizeof(dest_path), "%s/%s", target, filename);
 
         if (!strcmp(operation, "ADDED") || !strcmp(operation, "MODIFIED")) {
-            if (sync_file(src_path, dest_path) != -1) {
-                snprintf(details, sizeof(details), "File: %s", filename);
-                print_report("SUCCESS", details, NULL, source, target, operation);
-            } else {
-                char error_msg[300];
-                snprintf(error_msg, sizeof(error_msg), "File %s: %s", filename, strerror(errno));
-                print_report("ERROR", NULL, error_msg, source, target, operation);
-            }
-        } 
-        else if (strcmp(operation, "DELETED") != -1) {
-			// Try to delete the destination file
-            if (unlink(dest_path) == 0) {
-                snprintf(details, sizeof(details), "File: %s", filename);
-                print_report("SUCCESS", details, NULL, source, target, operation);
-            } else {
-				// If deletion fails print error message
-                char error_msg[300];
-                snprintf(error_msg, sizeof(error_msg), "File %s: %s", filename, strerror(errno));
-                print_report("ERROR", NULL, error_msg, source, target, operation);
-            }
+            CopyStats stats;
+            FileState state;
+            int result = sync_file(src_path, dest_path, NULL, &state, &stats);
+            fill_copy_report(&record, details, sizeof(details), filename, result, &stats, &state);
+        }
+        else if (!strcmp(operation, "DELETED")) {
+            // Try to delete the destination file, or directory tree
+            fill_delete_report(&record, details, sizeof(details), filename, remove_tree(dest_path));
+        }
+        else {
+            // Every job must produce exactly one report, so the manager can account for it
+            snprintf(details, sizeof(details), "Unknown operation %s", operation);
+            record.status = REPORT_ERROR;
+            record.errors = 1;
         }
-		else {
-			return -1;
-		}
     }
-    
-    return 0;
-}
\ No newline at end of file
+
+    record.duration_us = now_us() - start;
+    print_report(&record);
+    add_to_batch(batch, &record);
+}
+
+// Returns 1 for the operations that work on a single file of the target
+int single_file_operation(const char *operation) {
+    return !strcmp(operation, "ADDED") || !strcmp(operation, "MODIFIED") || !strcmp(operation, "DELETED");
+}
+
+#ifdef FSS_IO_URING
+// Returns 1 if a and b are the same path or one is inside the other, e.g. a deleted directory and a file in it
+int paths_overlap(const char *a, const char *b) {
+    size_t a_len = strlen(a), b_len = strlen(b);
+    if (a_len > b_len)
+        return paths_overlap(b, a);
+    return !strncmp(a, b, a_len) && (b[a_len] == '\0' || b[a_len] == '/');
+}
+
+// Function to find how many of the first count items can go through one ring: single file operations
+// on distinct paths, so that their order does not matter
+size_t uring_batch_length(BatchItem *items, size_t count) {
+    size_t length = 0;
+    while (length < count && single_file_operation(items[length].operation)) {
+        for (size_t i = 0; i < length; i++) {
+            if (paths_overlap(items[i].filename, items[length].filename))
+                return length;
+        }
+        length++;
+    }
+    return length;
+}
+
+// Function to run single file operations of a batch through one io_uring: the copies and the unlinks of
+// all files are in flight at once. Files for a delta copy go through sync_file(). The reports are counted in batch
+void sync_batch_uring(const char *source, const char *target, BatchItem *items, size_t count, ReportRecord *batch) {
+    UringCopyJob *jobs = calloc(count, sizeof(*jobs));
+    size_t *job_items = calloc(count, sizeof(*job_items));
+    int *results = calloc(count, sizeof(*results));
+    int *errors = calloc(count, sizeof(*errors));
+    CopyStats *stats = calloc(count, sizeof(*stats));
+    FileState *states = calloc(count, sizeof(*states));
+    char (*dest_paths)[PATH_MAX] = calloc(count, PATH_MAX);
+    size_t job_count = 0;
+    long long start = now_us();
+
+    for (size_t i = 0; i < count; i++) {
+        char src_path[PATH_MAX];
+        snprintf(src_path, sizeof(src_path), "%s/%s", source, items[i].filename);
+        snprintf(dest_paths[i], PATH_MAX, "%s/%s", target, items[i].filename);
+        stats[i].method = COPY_IO_URING;
+
+        if (!strcmp(items[i].operation, "DELETED")) {
+            jobs[job_count].dest = dest_paths[i];
+            job_items[job_count++] = i;
+            continue;
+        }
+        struct stat src_stat;
+        int delta = 0;
+        results[i] = check_file(src_path, dest_paths[i], NULL, &states[i], &src_stat, &delta);
+        if (results[i] == 0 && delta)
+            results[i] = sync_file(src_path, dest_paths[i], NULL, &states[i], &stats[i]);
+        else if (results[i] == 0) {
+            make_parent_dirs(dest_paths[i]);
+            jobs[job_count].src = strdup(src_path);
+            jobs[job_count].dest = dest_paths[i];
+            job_items[job_count++] = i;
+        }
+        errors[i] = errno;
+    }
+
+    int ret = job_count ? uring_copy_files(jobs, job_count, uring_depth) : 0;
+    for (size_t j = 0; j < job_count; j++) {
+        size_t i = job_items[j];
+        if (!jobs[j].src) {
+            // A directory cannot be unlinked, its whole tree goes the usual way
+            results[i] = ret == -1 || jobs[j].error == EISDIR ? remove_tree(dest_paths[i]) : jobs[j].result;
+            errors[i] = ret == -1 || jobs[j].error == EISDIR ? errno : jobs[j].error;
+            continue;
+        }
+        if (ret == -1) {
+            // The ring could not be set up after all: copy these ones the usual way
+            results[i] = sync_file(jobs[j].src, dest_paths[i], NULL, &states[i], &stats[i]);
+            errors[i] = errno;
+        }
+        else if ((results[i] = jobs[j].result) == 0) {
+            // Preserve the modification time, it is what tells later syncs that the target is up to date
+            struct timespec times[2] = { { 0, UTIME_OMIT }, states[i].mtime };
+            utimensat(AT_FDCWD, dest_paths[i], times, 0);
+            stats[i].bytes_written = jobs[j].bytes_written;
+            if (hash_contents)
+                states[i].hash = hash_file(jobs[j].src);
+        }
+        else {
+            errors[i] = jobs[j].error;
+        }
+        free((char *)jobs[j].src);
+    }
+
+    // Report in the order the manager sent the operations; they all took the time of the whole ring
+    long long duration = now_us() - start;
+    for (size_t i = 0; i < count; i++) {
+        char details[PATH_MAX + 100];
+        ReportRecord record = { REPORT_OPERATION, REPORT_SUCCESS };
+        record.source = source;
+        record.target = target;
+        record.operation = items[i].operation;
+        errno = errors[i];
+        if (!strcmp(items[i].operation, "DELETED"))
+            fill_delete_report(&record, details, sizeof(details), items[i].filename, results[i]);
+        else
+            fill_copy_report(&record, details, sizeof(details), items[i].filename, results[i], &stats[i], &states[i]);
+        record.duration_us = duration;
+        print_report(&record);
+        add_to_batch(batch, &record);
+    }
+
+    free(jobs);
+    free(job_items);
+    free(results);
+    free(errors);
+    free(stats);
+    free(states);
+    free(dest_paths);
+}
+#endif
+
+// Function to execute the operations of a batch in order, then print the report that closes it
+void run_batch(const char *source, const char *target, BatchItem *items, size_t count) {
+    ReportRecord batch = { REPORT_BATCH, REPORT_SUCCESS };
+    batch.source = source;
+    batch.target = target;
+    batch.operation = "BATCH";
+    long long start = now_us();
+
+    size_t i = 0;
+    while (i < count) {
+#ifdef FSS_IO_URING
+        // Consecutive operations on distinct files share one ring, whose reads go through the page cache
+        size_t length = uring_depth && cache_policy == CACHE_KEEP ? uring_batch_length(items + i, count - i) : 0;
+        if (length > 1) {
+            sync_batch_uring(source, target, items + i, length, &batch);
+            i += length;
+            continue;
+        }
+#endif
+        run_job(source, target, items[i].filename, items[i].operation, &batch);
+        i++;
+    }
+
+    if (batch.errors)
+        batch.status = batch.files ? REPORT_PARTIAL : REPORT_ERROR;
+    batch.duration_us = now_us() - start;
+    print_report(&batch);
+}
+
+// Function to read one line of stdin without its newline. Returns -1 at the end of the input
+ssize_t read_job_line(char **line, size_t *cap) {
+    ssize_t len = getline(line, cap, stdin);
+    if (len > 0 && (*line)[len - 1] == '\n')
+        (*line)[--len] = '\0';
+    return len;
+}
+
+// Function to serve the batches sent by the manager until it closes our stdin. A batch is a
+// "BATCH\t<source>\t<target>\t<count>\t<cache_policy>\t<direct_min_bytes>" line followed by count
+// "<operation>\t<filename>" lines
+void serve_jobs() {
+    char *line = NULL;
+    size_t cap = 0;
+
+    while (read_job_line(&line, &cap) >= 0) {
+        char *tag = strtok(line, "\t");
+        char *source = strtok(NULL, "\t");
+        char *target = strtok(NULL, "\t");
+        char *count_str = strtok(NULL, "\t");
+        char *policy_str = strtok(NULL, "\t");
+        char *direct_min_str = strtok(NULL, "\t");
+        long count = count_str ? atol(count_str) : 0;
+
+        if (!tag || strcmp(tag, "BATCH") || !source || !target || count < 1) {
+            // Still close a batch, so the manager frees us
+            ReportRecord record = { REPORT_OPERATION, REPORT_ERROR };
+            record.source = source ? source : "";
+            record.target = target ? target : "";
+            record.operation = "UNKNOWN";
+            record.details = "Malformed job";
+            record.errors = 1;
+            print_report(&record);
+            record.type = REPORT_BATCH;
+            print_report(&record);
+            continue;
+        }
+        source = strdup(job_field_unescape(source));
+        target = strdup(job_field_unescape(target));
+
+        // The cache settings belong to the sync pair, a batch without them is copied through the cache
+        int policy = policy_str ? cache_policy_parse(policy_str) : -1;
+        cache_policy = policy != -1 ? (CachePolicy)policy : CACHE_KEEP;
+        direct_min_size = direct_min_str ? atoll(direct_min_str) : DIRECT_MIN_SIZE;
+
+        // Read the whole batch before running it, the manager may still be writing it
+        BatchItem *items = calloc(count, sizeof(*items));
+        long read_count = 0;
+        for (; read_count < count && read_job_line(&line, &cap) >= 0; read_count++) {
+            char *operation = strtok(line, "\t");
+            char *filename = strtok(NULL, "");
+            items[read_count].operation = strdup(operation ? operation : "");
+            // A rename stays escaped, run_job splits it on the tab between its two paths first
+            if (filename && (!operation || strcmp(operation, "RENAMED")))
+                job_field_unescape(filename);
+            items[read_count].filename = strdup(filename ? filename : "");
+        }
+
+        run_batch(source, target, items, read_count);
+        for (long i = 0; i < read_count; i++) {
+            free(items[i].operation);
+            free(items[i].filename);
+        }
+        free(items);
+        free(source);
+        free(target);
+    }
+    free(line);
+}
+
+int main(int argc, char *argv[]) {
+    int arg = 1;
+    while (arg < argc && argv[arg][0] == '-') {
+        if (!strcmp(argv[arg], "-t") && arg + 1 < argc) {
+            copy_threads = atoi(argv[arg + 1]);
+            if (copy_threads < 1)
+                copy_threads = 1;
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-S") && arg + 1 < argc) {
+            slice_files = atol(argv[arg + 1]) > 0 ? atol(argv[arg + 1]) : 0;
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-D") && arg + 1 < argc) {
+            delta_min_size = atoll(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-C") && arg + 1 < argc && cache_policy_parse(argv[arg + 1]) != -1) {
+            cache_policy = cache_policy_parse(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (!strcmp(argv[arg], "-M") && arg + 1 < argc) {
+            direct_min_size = atoll(argv[arg + 1]);
+            arg += 2;
+        }
+#ifdef FSS_IO_URING
+        else if (!strcmp(argv[arg], "-q") && arg + 1 < argc) {
+            uring_depth = atoi(argv[arg + 1]);
+            arg += 2;
+        }
+#endif
+        else if (!strcmp(argv[arg], "-H")) {
+            hash_contents = 1;
+            arg++;
+        }
+        else {
+            break;
+        }
+    }
+
+#ifdef FSS_IO_URING
+    // Fall back to the copy threads when the kernel does not let us use io_uring
+    if (uring_depth && !uring_available())
+        uring_depth = 0;
+#endif
+
+    if (arg == argc) {
+        // Persistent mode: the manager keeps us alive, streams jobs through stdin and reads binary reports
+        binary_reports = 1;
+        serve_jobs();
+        return 0;
+    }
+
+    if (argc - arg != 4) {
+        fprintf(stderr, "Usage: %s [-t <copy_threads>] [-H] [-D <delta_min_bytes>] [-S <slice_files>] [-C <keep|stream|direct>] [-M <direct_min_bytes>] [<source> <target> <filename> <operation>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    ReportRecord batch = { REPORT_BATCH };
+    run_job(argv[arg], argv[arg + 1], argv[arg + 2], argv[arg + 3], &batch);
+    return batch.errors ? EXIT_FAILURE : 0;
+}